@@ -21,10 +21,28 @@
 
 #include "aatree.h"
 
+// nodes are carved out of slabs that double in size up to AATREE_SLAB_MAX
+#define AATREE_SLAB_MIN 64
+#define AATREE_SLAB_MAX 65536
+
+struct aatree_slab {
+	struct aatree_slab* next;
+	size_t capacity;
+	struct aatree_node nodes[];
+};
+
 static struct aatree_node* aatree_node_create(struct aatree* self, int level, void* value);
 static void aatree_node_destroy(struct aatree* self, struct aatree_node* node, bool recursively);
-static void aatree_node_insert(struct aatree* self, struct aatree_node** node, void* value);
-static void aatree_node_remove(struct aatree* self, struct aatree_node** a_node, void* value);
+static inline int aatree_node_compare_keys(struct aatree* self, struct aatree_node* lhs, struct aatree_node* rhs);
+static struct aatree* aatree_build(aatree_compare compare, void** values, size_t size);
+static struct aatree_node* aatree_node_build(struct aatree* self, void** values, size_t size);
+static uint32_t aatree_node_count(struct aatree* self, struct aatree_node* node);
+static struct aatree* aatree_merge(struct aatree* lhs, struct aatree* rhs, int keep);
+static struct aatree_node** aatree_node_search(struct aatree* self, struct aatree_node* key, struct aatree_node*** path, int* a_depth);
+static void aatree_node_rebalance_insert(struct aatree* self, struct aatree_node*** path, int depth);
+static struct aatree_node* aatree_node_unlink(struct aatree* self, struct aatree_node* key);
+static void aatree_node_skew(struct aatree* self, struct aatree_node** a_node);
+static void aatree_node_split(struct aatree* self, struct aatree_node** a_node);
 
 struct aatree* aatree_create(aatree_compare compare) {
 	struct aatree* self = (struct aatree*)calloc(1, sizeof(struct aatree));
@@ -33,35 +51,64 @@ struct aatree* aatree_create(aatree_compare compare) {
 
 	self->priv.bottom.left = &self->priv.bottom;
 	self->priv.bottom.right = &self->priv.bottom;
-	self->priv.deleted = &self->priv.bottom;
+	self->root = &self->priv.bottom;
 
 	self->compare = compare;
 	return self;
 }
 
 void aatree_destroy(struct aatree* self) {
-	aatree_node_destroy(self, self->root->left, true);
-	aatree_node_destroy(self, self->root->right ,true);
+	// every node lives in a slab, releasing the slabs releases the whole tree
+	struct aatree_slab* slab = self->priv.slabs;
+	while(slab) {
+		struct aatree_slab* next = slab->next;
+		free(slab);
+		slab = next;
+	}
 	memset(self, 0, sizeof(struct aatree)), free(self);
 }
 
-int aatree_insert(struct aatree* self, void* value) {
-	if(!self->size) {
-		self->root = aatree_node_create(self, 1, value);
-		if(!self->root)
-			return 1;
-
-		self->size += 1;
-		return 0;
+struct aatree* aatree_build_sorted(aatree_compare compare, void** values, size_t size) {
+	for(size_t i = 1; i < size; ++i) {
+		if(compare(values[i - 1], values[i]) >= 0)
+			return NULL; // not strictly ascending
 	}
 
-	aatree_node_insert(self, &self->root, value);
-	if(self->priv.error) {
-		self->priv.error = 0;
+	return aatree_build(compare, values, size);
+}
+
+// which values of a merge survive
+#define AATREE_MERGE_LHS	1	// only in lhs
+#define AATREE_MERGE_RHS	2	// only in rhs
+#define AATREE_MERGE_BOTH	4	// in both, the lhs one is kept
+
+struct aatree* aatree_union(struct aatree* lhs, struct aatree* rhs) {
+	return aatree_merge(lhs, rhs, AATREE_MERGE_LHS | AATREE_MERGE_RHS | AATREE_MERGE_BOTH);
+}
+
+struct aatree* aatree_intersection(struct aatree* lhs, struct aatree* rhs) {
+	return aatree_merge(lhs, rhs, AATREE_MERGE_BOTH);
+}
+
+struct aatree* aatree_difference(struct aatree* lhs, struct aatree* rhs) {
+	return aatree_merge(lhs, rhs, AATREE_MERGE_LHS);
+}
+
+int aatree_insert(struct aatree* self, void* value) {
+	struct aatree_node** path[AATREE_MAX_HEIGHT];
+	struct aatree_node key = { .value = value };
+	int depth;
+	struct aatree_node** link = aatree_node_search(self, &key, path, &depth);
+	if(!link)
+		return 1; // key conflict
+
+	struct aatree_node* node = aatree_node_create(self, 1, value);
+	if(!node)
 		return 1;
-	}
 
+	*link = node;
 	self->size += 1;
+	aatree_node_rebalance_insert(self, path, depth);
 	return 0;
 }
 
@@ -69,45 +116,239 @@ int aatree_remove(struct aatree* self, void* value) {
 	if(!self->size)
 		return 1;
 
-	aatree_node_remove(self, &self->root, value);
-	if(self->priv.remove_performed) {
-		self->priv.remove_performed = 0;
-		self->priv.removed_value = NULL;
-		self->size -= 1;
+	struct aatree_node key = { .value = value };
+	struct aatree_node* node = aatree_node_unlink(self, &key);
+	if(node)
+		aatree_node_destroy(self, node, false);
+
+	return 0;
+}
+
+struct aatree* aatree_create_intrusive(aatree_node_compare compare) {
+	struct aatree* self = aatree_create(NULL);
+	if(!self)
+		return NULL;
+
+	self->node_compare = compare;
+	return self;
+}
+
+int aatree_insert_node(struct aatree* self, struct aatree_node* node) {
+	struct aatree_node** path[AATREE_MAX_HEIGHT];
+	int depth;
+	struct aatree_node** link = aatree_node_search(self, node, path, &depth);
+	if(!link)
+		return 1; // key conflict
+
+	node->value = node;
+	node->left = &self->priv.bottom;
+	node->right = &self->priv.bottom;
+	node->level = 1;
+	node->count = 1;
+
+	*link = node;
+	self->size += 1;
+	aatree_node_rebalance_insert(self, path, depth);
+	return 0;
+}
+
+struct aatree_node* aatree_remove_node(struct aatree* self, struct aatree_node* key) {
+	if(!self->size)
+		return NULL;
+
+	return aatree_node_unlink(self, key);
+}
+
+struct aatree_node* aatree_find_node(struct aatree* self, struct aatree_node* key) {
+	struct aatree_node* node = self->root;
+	while(node != &self->priv.bottom) {
+		int cmp = aatree_node_compare_keys(self, key, node);
+		if(cmp == 0)
+			return node;
+
+		node = cmp < 0 ? node->left : node->right;
 	}
 
-	if(self->size)
-		assert(self->root != &self->priv.bottom);
+	return NULL;
+}
+
+int aatree_enable_counts(struct aatree* self) {
+	if(self->size > UINT32_MAX)
+		return 1; // subtree counts would overflow
 
+	aatree_node_count(self, self->root);
+	self->counted = true;
 	return 0;
 }
 
+void* aatree_select(struct aatree* self, size_t k) {
+	if(k >= self->size)
+		return NULL;
+
+	if(!self->counted) {
+		// no counts to skip subtrees with, walk to the k-th node in order
+		struct aatree_iterator iterator;
+		aatree_range_node(self, &iterator, NULL, NULL);
+		struct aatree_node* node = aatree_iterator_next(&iterator);
+		while(k--)
+			node = aatree_iterator_next(&iterator);
+		return node->value;
+	}
+
+	struct aatree_node* node = self->root;
+	while(k != node->left->count) {
+		if(k < node->left->count) {
+			node = node->left;
+		} else {
+			k -= node->left->count + 1;
+			node = node->right;
+		}
+	}
+
+	return node->value;
+}
+
+size_t aatree_rank(struct aatree* self, void* value) {
+	struct aatree_node key = { .value = value };
+	return aatree_rank_node(self, &key);
+}
+
+size_t aatree_rank_node(struct aatree* self, struct aatree_node* key) {
+	size_t rank = 0;
+	if(!self->counted) {
+		struct aatree_iterator iterator;
+		struct aatree_node* node;
+		aatree_range_node(self, &iterator, NULL, NULL);
+		while((node = aatree_iterator_next(&iterator)) && aatree_node_compare_keys(self, key, node) > 0)
+			++rank;
+		return rank;
+	}
+
+	struct aatree_node* node = self->root;
+	while(node != &self->priv.bottom) {
+		int cmp = aatree_node_compare_keys(self, key, node);
+		if(cmp <= 0) {
+			if(cmp == 0)
+				return rank + node->left->count;
+
+			node = node->left;
+		} else {
+			rank += node->left->count + 1;
+			node = node->right;
+		}
+	}
+
+	return rank;
+}
+
 size_t aatree_size(struct aatree* self) {
 	return self->size;
 }
 
 void* aatree_find(struct aatree* self, void* value) {
-	if(!self->size)
-		return NULL;
-
 	// perform 2-way search for better performance
 	// @see [A Note on Searching in a Binary Search Tree](http://user.it.uu.se/~arnea/ps/searchproc.pdf)
+	struct aatree_node key = { .value = value };
 	struct aatree_node* node = self->root;
 	struct aatree_node* candidate = NULL;
-	while(node) {
-		if(self->compare(node->value, value) > 0)
+	while(node != &self->priv.bottom) {
+		if(aatree_node_compare_keys(self, node, &key) > 0)
 			node = node->left;
 		else {
 			candidate = node;
 			node = node->right;
 		}
 	}
-	if(candidate && self->compare(candidate->value, value) == 0)
-		return candidate;
+	if(candidate && aatree_node_compare_keys(self, candidate, &key) == 0)
+		return candidate->value;
 	else
 		return NULL;
 }
 
+void* aatree_lower_bound(struct aatree* self, void* value) {
+	struct aatree_node key = { .value = value };
+	struct aatree_node* node = aatree_lower_bound_node(self, &key);
+	return node ? node->value : NULL;
+}
+
+void* aatree_upper_bound(struct aatree* self, void* value) {
+	struct aatree_node key = { .value = value };
+	struct aatree_node* node = aatree_upper_bound_node(self, &key);
+	return node ? node->value : NULL;
+}
+
+struct aatree_node* aatree_lower_bound_node(struct aatree* self, struct aatree_node* key) {
+	struct aatree_node* node = self->root;
+	struct aatree_node* candidate = NULL;
+	while(node != &self->priv.bottom) {
+		if(aatree_node_compare_keys(self, key, node) <= 0) {
+			candidate = node;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+	return candidate;
+}
+
+struct aatree_node* aatree_upper_bound_node(struct aatree* self, struct aatree_node* key) {
+	struct aatree_node* node = self->root;
+	struct aatree_node* candidate = NULL;
+	while(node != &self->priv.bottom) {
+		if(aatree_node_compare_keys(self, key, node) < 0) {
+			candidate = node;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+	return candidate;
+}
+
+void aatree_range(struct aatree* self, struct aatree_iterator* iterator, void* lo, void* hi) {
+	struct aatree_node lo_key = { .value = lo };
+	iterator->hi_key.value = hi;
+	aatree_range_node(self, iterator, &lo_key, &iterator->hi_key);
+}
+
+void aatree_range_node(struct aatree* self, struct aatree_iterator* iterator, struct aatree_node* lo, struct aatree_node* hi) {
+	iterator->tree = self;
+	iterator->hi = hi;
+	iterator->depth = 0;
+
+	// stack up the nodes we pass on the left, the top one is the lower bound
+	struct aatree_node* node = self->root;
+	while(node != &self->priv.bottom) {
+		if(!lo || aatree_node_compare_keys(self, lo, node) <= 0) {
+			assert(iterator->depth < AATREE_MAX_HEIGHT);
+			iterator->stack[iterator->depth++] = node;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+}
+
+struct aatree_node* aatree_iterator_next(struct aatree_iterator* iterator) {
+	if(!iterator->depth)
+		return NULL;
+
+	struct aatree* self = iterator->tree;
+	struct aatree_node* node = iterator->stack[--iterator->depth];
+	if(iterator->hi && aatree_node_compare_keys(self, node, iterator->hi) > 0) {
+		iterator->depth = 0;
+		return NULL;
+	}
+
+	// the successors are the leftmost path of the right subtree
+	for(struct aatree_node* next = node->right; next != &self->priv.bottom; next = next->left) {
+		assert(iterator->depth < AATREE_MAX_HEIGHT);
+		iterator->stack[iterator->depth++] = next;
+	}
+
+	return node;
+}
+
 void* aatree_find_min(struct aatree* self) {
 	if(!self->size)
 		return NULL;
@@ -154,11 +395,32 @@ void aatree_iterate_backward(struct aatree* self, aatree_iteration_callback call
 }
 
 static struct aatree_node* aatree_node_create(struct aatree* self, int level, void* value) {
-	struct aatree_node* node = (struct aatree_node*)calloc(1, sizeof(struct aatree_node));
-	if(!node)
-		return NULL;
+	struct aatree_node* node = self->priv.free_nodes;
+	struct aatree_slab* slab = self->priv.slabs;
+	if(node) {
+		// reuse a released node
+		self->priv.free_nodes = node->left;
+	} else if(slab && self->priv.slab_used < slab->capacity) {
+		// carve the next node out of the newest slab, next to the previous one
+		node = &slab->nodes[self->priv.slab_used++];
+	} else {
+		size_t capacity = slab ? slab->capacity * 2 : AATREE_SLAB_MIN;
+		if(capacity > AATREE_SLAB_MAX)
+			capacity = AATREE_SLAB_MAX;
+
+		slab = (struct aatree_slab*)malloc(sizeof(struct aatree_slab) + capacity * sizeof(struct aatree_node));
+		if(!slab)
+			return NULL;
+
+		slab->next = self->priv.slabs;
+		slab->capacity = capacity;
+		self->priv.slabs = slab;
+		self->priv.slab_used = 1;
+		node = &slab->nodes[0];
+	}
 
 	node->level = level;
+	node->count = 1;
 	node->value = value;
 	node->left = &self->priv.bottom;
 	node->right = &self->priv.bottom;
@@ -174,89 +436,216 @@ static void aatree_node_destroy(struct aatree* self, struct aatree_node* node, b
 		aatree_node_destroy(self, node->right, true);
 	}
 
-	free(node);
+	// back to the free list, the slab is released with the tree
+	node->left = self->priv.free_nodes;
+	self->priv.free_nodes = node;
 }
 
-// skew (rotate right)
-static void aatree_node_skew(struct aatree* self, struct aatree_node** a_node) {
-	if((*a_node)->left->level != (*a_node)->level)
-		return;
+// create a tree holding size strictly ascending values
+static struct aatree* aatree_build(aatree_compare compare, void** values, size_t size) {
+	struct aatree* self = aatree_create(compare);
+	if(!self)
+		return NULL;
 
-	struct aatree_node* temp;
-	struct aatree_node* node = *a_node;
-	temp = node;
-	node = node->left;
-	temp->left = node->right;
-	node->right = temp;
-	*a_node = node;
+	struct aatree_node* root = aatree_node_build(self, values, size);
+	if(!root) {
+		aatree_destroy(self);
+		return NULL;
+	}
+
+	self->root = root;
+	self->size = size;
+	return self;
 }
 
-// split (rotate left)
-static void aatree_node_split(struct aatree* self, struct aatree_node** a_node) {
-	if((*a_node)->right->right->level != (*a_node)->level)
-		return;
+// build a subtree from size ascending values. a subtree of n nodes gets level
+// floor(log2(n + 1)): halves of equal size sit one level down, and when the
+// right half is one node larger it is a perfect tree, either one level down
+// or a horizontal link whose own children are one level down
+static struct aatree_node* aatree_node_build(struct aatree* self, void** values, size_t size) {
+	if(!size)
+		return &self->priv.bottom;
+
+	// nodes are created in order, so neighbours share slabs
+	size_t mid = (size - 1) / 2;
+	struct aatree_node* left = aatree_node_build(self, values, mid);
+	if(!left)
+		return NULL;
 
-	struct aatree_node* temp;
-	struct aatree_node* node = *a_node;
-	temp = node;
-	node = node->right;
-	temp->right = node->left;
-	node->left = temp;
-	node->level += 1;
-	*a_node = node;
+	struct aatree_node* node = aatree_node_create(self, 63 - __builtin_clzll(size + 1), values[mid]);
+	if(!node)
+		return NULL;
+
+	struct aatree_node* right = aatree_node_build(self, values + mid + 1, size - mid - 1);
+	if(!right)
+		return NULL;
+
+	node->left = left;
+	node->right = right;
+	node->count = size; // free to set here, a merge into a counted tree relies on it
+	return node;
 }
 
-static void aatree_node_insert(struct aatree* self, struct aatree_node** a_node, void* value) {
-	if((*a_node) == &self->priv.bottom) {
-		struct aatree_node* node = aatree_node_create(self, 1, value);
-		if(!node) {
-			self->priv.error = 1;
-			return;
+// recount every subtree below node, return the count of node
+static uint32_t aatree_node_count(struct aatree* self, struct aatree_node* node) {
+	if(node == &self->priv.bottom)
+		return 0;
+
+	node->count = aatree_node_count(self, node->left) + aatree_node_count(self, node->right) + 1;
+	return node->count;
+}
+
+// merge two value trees in order into a sorted array, then build the result from it
+static struct aatree* aatree_merge(struct aatree* lhs, struct aatree* rhs, int keep) {
+	if(lhs->node_compare || rhs->node_compare)
+		return NULL; // intrusive nodes can't be shared
+
+	void** values = (void**)malloc((lhs->size + rhs->size + 1) * sizeof(void*));
+	if(!values)
+		return NULL;
+
+	struct aatree_iterator lhs_iterator, rhs_iterator;
+	aatree_range_node(lhs, &lhs_iterator, NULL, NULL);
+	aatree_range_node(rhs, &rhs_iterator, NULL, NULL);
+	struct aatree_node* l = aatree_iterator_next(&lhs_iterator);
+	struct aatree_node* r = aatree_iterator_next(&rhs_iterator);
+	size_t size = 0;
+	while(l || r) {
+		int cmp = !l ? 1 : !r ? -1 : lhs->compare(l->value, r->value);
+		if(cmp < 0) {
+			if(keep & AATREE_MERGE_LHS)
+				values[size++] = l->value;
+			l = aatree_iterator_next(&lhs_iterator);
+		} else if(cmp > 0) {
+			if(keep & AATREE_MERGE_RHS)
+				values[size++] = r->value;
+			r = aatree_iterator_next(&rhs_iterator);
+		} else {
+			if(keep & AATREE_MERGE_BOTH)
+				values[size++] = l->value;
+			l = aatree_iterator_next(&lhs_iterator);
+			r = aatree_iterator_next(&rhs_iterator);
 		}
+	}
 
-		*a_node = node;
-		return;
+	// the result counts subtrees like lhs, the build already counted them
+	struct aatree* self = NULL;
+	if(!lhs->counted || size <= UINT32_MAX)
+		self = aatree_build(lhs->compare, values, size);
+	if(self)
+		self->counted = lhs->counted;
+	free(values);
+	return self;
+}
+
+static inline int aatree_node_compare_keys(struct aatree* self, struct aatree_node* lhs, struct aatree_node* rhs) {
+	if(self->node_compare)
+		return self->node_compare(lhs, rhs);
+
+	return self->compare(lhs->value, rhs->value);
+}
+
+// search down the tree, remembering the link to every node passed.
+// return the empty link where key belongs, or NULL if key is already present
+// or a counted tree is full
+static struct aatree_node** aatree_node_search(struct aatree* self, struct aatree_node* key, struct aatree_node*** path, int* a_depth) {
+	if(self->counted && self->size >= UINT32_MAX)
+		return NULL; // subtree counts would overflow
+
+	struct aatree_node** link = &self->root;
+	int depth = 0;
+	while(*link != &self->priv.bottom) {
+		int cmp = aatree_node_compare_keys(self, key, *link);
+		if(cmp == 0)
+			return NULL;
+
+		assert(depth < AATREE_MAX_HEIGHT);
+		path[depth++] = link;
+		link = cmp < 0 ? &(*link)->left : &(*link)->right;
 	}
 
-	if(self->compare(value, (*a_node)->value) < 0)
-		aatree_node_insert(self, &(*a_node)->left, value);
-	else if(self->compare(value, (*a_node)->value) > 0)
-		aatree_node_insert(self, &(*a_node)->right, value);
-	else
-		self->priv.error = 1; // key conflict
+	*a_depth = depth;
+	return link;
+}
 
-	if(!self->priv.error) {
-		aatree_node_skew(self, a_node);
-		aatree_node_split(self, a_node);
+// on the way back from an insertion, we rebalance. split looks two levels
+// down, so we can stop once two subtrees in a row come out unchanged
+static void aatree_node_rebalance_insert(struct aatree* self, struct aatree_node*** path, int depth) {
+	// every subtree on the path gained the new node, rotations keep the counts right
+	if(self->counted)
+		for(int i = 0; i < depth; ++i)
+			(*path[i])->count += 1;
+
+	int unchanged = 0;
+	while(depth-- && unchanged < 2) {
+		struct aatree_node* top = *path[depth];
+		int level = top->level;
+		aatree_node_skew(self, path[depth]);
+		aatree_node_split(self, path[depth]);
+		if(*path[depth] == top && top->level == level)
+			unchanged += 1;
+		else
+			unchanged = 0;
 	}
 }
 
-static void aatree_node_remove(struct aatree* self, struct aatree_node** a_node, void* value) {
-	if(*a_node == &self->priv.bottom)
-		return;
+// take the node equal to key out of the tree and return it, NULL if not found.
+// on value trees the returned node may be another one, carrying the removed value
+static struct aatree_node* aatree_node_unlink(struct aatree* self, struct aatree_node* key) {
+	// search down the tree, the last node passed on the right is the candidate
+	struct aatree_node** path[AATREE_MAX_HEIGHT];
+	struct aatree_node** link = &self->root;
+	struct aatree_node* deleted = NULL;
+	int deleted_depth = 0;
+	int depth = 0;
+	while(*link != &self->priv.bottom) {
+		struct aatree_node* node = *link;
+		int cmp = aatree_node_compare_keys(self, key, node);
+		assert(depth < AATREE_MAX_HEIGHT);
+		path[depth++] = link;
+		if(cmp < 0) {
+			link = &node->left;
+		} else {
+			deleted = cmp == 0 ? node : NULL;
+			deleted_depth = depth - 1;
+			link = &node->right;
+		}
+	}
 
-	// search down the tree and set pointers last and deleted
-	struct aatree_node* node = *a_node;
-	self->priv.last = node;
+	if(!deleted)
+		return NULL;
+
+	// at the bottom of the tree we unlink the last node passed,
+	// every subtree above it loses one node
+	struct aatree_node* last = *path[--depth];
+	if(self->counted)
+		for(int i = 0; i < depth; ++i)
+			(*path[i])->count -= 1;
+	*path[depth] = last->right;
+	if(last != deleted && !self->node_compare) {
+		// the last node's value moves up and the node itself is released
+		void* value = deleted->value;
+		deleted->value = last->value;
+		last->value = value;
+		deleted = last;
+	} else if(last != deleted) {
+		// intrusive nodes belong to the caller, so the last node takes the place of the deleted one
+		last->left = deleted->left;
+		last->right = deleted->right;
+		last->level = deleted->level;
+		last->count = deleted->count;
+		*path[deleted_depth] = last;
+		path[deleted_depth + 1] = &last->right;
+	}
+	self->size -= 1;
+
+	// on the way back, we rebalance until a node keeps its level
+	while(depth--) {
+		struct aatree_node** a_node = path[depth];
+		struct aatree_node* node = *a_node;
+		if(node->left->level >= node->level - 1 && node->right->level >= node->level - 1)
+			break;
 
-	if(self->compare(value, node->value) < 0) {
-		aatree_node_remove(self, &node->left, value);
-	} else {
-		self->priv.deleted = node;
-		aatree_node_remove(self, &node->right, value);
-	}
-
-	if(node == self->priv.last && self->priv.deleted != &self->priv.bottom
-			&& self->compare(value, self->priv.deleted->value) == 0) {
-		// at the bottom of the tree we remove the element if it is present
-		self->priv.remove_performed = 1;
-		self->priv.removed_value = self->priv.deleted->value;
-		self->priv.deleted->value = node->value;
-		self->priv.deleted = &self->priv.bottom;
-		*a_node = node->right;
-		aatree_node_destroy(self, self->priv.last, false);
-	} else if(node->left->level < node->level - 1 || node->right->level < node->level -1) {
-		// on the way back, we rebalance
 		node->level -= 1;
 		if(node->right->level > node->level)
 			node->right->level = node->level;
@@ -268,6 +657,45 @@ static void aatree_node_remove(struct aatree* self, struct aatree_node** a_node,
 		aatree_node_split(self, a_node), node = *a_node;
 		aatree_node_split(self, &node->right);
 	}
+
+	return deleted;
+}
+
+// skew (rotate right)
+static void aatree_node_skew(struct aatree* self, struct aatree_node** a_node) {
+	if(*a_node == &self->priv.bottom || (*a_node)->left->level != (*a_node)->level)
+		return;
+
+	struct aatree_node* temp;
+	struct aatree_node* node = *a_node;
+	temp = node;
+	node = node->left;
+	temp->left = node->right;
+	node->right = temp;
+	if(self->counted) {
+		node->count = temp->count;
+		temp->count = temp->left->count + temp->right->count + 1;
+	}
+	*a_node = node;
+}
+
+// split (rotate left)
+static void aatree_node_split(struct aatree* self, struct aatree_node** a_node) {
+	if(*a_node == &self->priv.bottom || (*a_node)->right->right->level != (*a_node)->level)
+		return;
+
+	struct aatree_node* temp;
+	struct aatree_node* node = *a_node;
+	temp = node;
+	node = node->right;
+	temp->right = node->left;
+	node->left = temp;
+	node->level += 1;
+	if(self->counted) {
+		node->count = temp->count;
+		temp->count = temp->left->count + temp->right->count + 1;
+	}
+	*a_node = node;
 }
 
 #ifndef NDBUG
@@ -309,6 +737,51 @@ int aatree_node_dump(struct aatree* self, struct aatree_node* base, int indent)
 	return nchild;
 }
 
+// verify AA tree invariants and ordering, return number of nodes
+size_t aatree_node_check(struct aatree* self, struct aatree_node* node, intptr_t lo, intptr_t hi) {
+	if(node == &self->priv.bottom)
+		return 0;
+
+	intptr_t value = (intptr_t)node->value;
+	assert(lo < value && value < hi);
+	assert(node->left->level == node->level - 1);
+	assert(node->right->level == node->level || node->right->level == node->level - 1);
+	assert(node->right->right->level < node->level);
+	assert(node->level > 1 || (node->left == &self->priv.bottom));
+	assert(!self->counted || node->count == node->left->count + node->right->count + 1);
+	return aatree_node_check(self, node->left, lo, value) + 1
+		+ aatree_node_check(self, node->right, value, hi);
+}
+
+struct item {
+	int key;
+	struct aatree_node node;
+};
+
+int item_compare(struct aatree_node* lhs, struct aatree_node* rhs) {
+	return aatree_entry(lhs, struct item, node)->key - aatree_entry(rhs, struct item, node)->key;
+}
+
+void check_item_order(struct aatree* self, void* value, void* context) {
+	struct item* item = aatree_entry((struct aatree_node*)value, struct item, node);
+	int* prev = (int*)context;
+	assert(item->key > *prev);
+	*prev = item->key;
+}
+
+// verify AA tree levels of an intrusive tree, return number of nodes
+size_t aatree_node_check_levels(struct aatree* self, struct aatree_node* node) {
+	if(node == &self->priv.bottom)
+		return 0;
+
+	assert(node->value == node);
+	assert(!self->counted || node->count == node->left->count + node->right->count + 1);
+	assert(node->left->level == node->level - 1);
+	assert(node->right->level == node->level || node->right->level == node->level - 1);
+	assert(node->right->right->level < node->level);
+	return aatree_node_check_levels(self, node->left) + 1 + aatree_node_check_levels(self, node->right);
+}
+
 void print_value(struct aatree* self, void* value, void* context) {
 	printf("%ld\n", (intptr_t)value);
 }
@@ -333,6 +806,211 @@ int main(int argc, char** argv) {
 		aatree_remove(tree, (void*)(intptr_t)i);
 	e = clock();
 	printf("[DELETE] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+
+	// released nodes are reused before the slabs grow
+	struct aatree_slab* slabs = tree->priv.slabs;
+	size_t slab_used = tree->priv.slab_used;
+	for(int i = 0; i < 1000000; ++i)
+		aatree_insert(tree, (void*)(intptr_t)i);
+	assert(tree->priv.slabs == slabs && tree->priv.slab_used == slab_used);
+	assert(tree->priv.free_nodes == NULL);
+
+	struct aatree_iterator iterator;
+	size_t visited = 0;
+	b = clock();
+	for(int i = 0; i < 1000; ++i) {
+		intptr_t lo = i * 997;
+		aatree_range(tree, &iterator, (void*)lo, (void*)(lo + 999));
+		while(aatree_iterator_next(&iterator))
+			++visited;
+	}
+	e = clock();
+	assert(visited == 1000 * 1000);
+	printf("[RANGE] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+
+	b = clock();
+	aatree_destroy(tree);
+	e = clock();
+	printf("[DESTROY] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+
+	// subtree counts are paid for only by trees asking for them
+	tree = aatree_create(int_compare);
+	aatree_enable_counts(tree);
+	b = clock();
+	for(int i = 0; i < 1000000; ++i)
+		aatree_insert(tree, (void*)(intptr_t)i);
+	e = clock();
+	printf("[INSERT counted] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	aatree_destroy(tree);
+
+	// random operations against a reference set
+	tree = aatree_create(int_compare);
+	bool present[1024] = { false };
+	srand(0);
+	for(int i = 0; i < 200000; ++i) {
+		intptr_t value = rand() % 1024;
+		if(i == 100000)
+			assert(aatree_enable_counts(tree) == 0 && tree->counted);
+		if(rand() % 2) {
+			assert(aatree_insert(tree, (void*)value) == (present[value] ? 1 : 0));
+			present[value] = true;
+		} else {
+			int empty = tree->size == 0;
+			assert(aatree_remove(tree, (void*)value) == empty);
+			present[value] = false;
+		}
+		if(i % 1000 == 0)
+			assert(aatree_node_check(tree, tree->root, -1, 1024) == tree->size);
+	}
+	size_t expected = 0;
+	for(int i = 0; i < 1024; ++i)
+		expected += present[i];
+	assert(aatree_node_check(tree, tree->root, -1, 1024) == expected && tree->size == expected);
+
+	// order statistics against the reference set
+	size_t rank = 0;
+	for(intptr_t i = 0; i < 1024; ++i) {
+		assert(aatree_rank(tree, (void*)i) == rank);
+		if(present[i])
+			assert((intptr_t)aatree_select(tree, rank++) == i);
+	}
+	assert(aatree_rank(tree, (void*)(intptr_t)1024) == expected);
+	assert(aatree_select(tree, expected) == NULL);
+
+	// bounded lookups and ranges against the reference set
+	for(intptr_t i = 0; i < 1024; ++i) {
+		intptr_t lower = i, upper = i + 1;
+		while(lower < 1024 && !present[lower])
+			++lower;
+		while(upper < 1024 && !present[upper])
+			++upper;
+		assert(aatree_find(tree, (void*)i) == (present[i] ? (void*)i : NULL));
+		assert(aatree_lower_bound(tree, (void*)i) == (lower < 1024 ? (void*)lower : NULL));
+		assert(aatree_upper_bound(tree, (void*)i) == (upper < 1024 ? (void*)upper : NULL));
+	}
+	for(int i = 0; i < 1000; ++i) {
+		intptr_t lo = rand() % 1100 - 50, hi = lo + rand() % 200;
+		struct aatree_iterator iterator;
+		struct aatree_node* node;
+		intptr_t next = lo < 0 ? 0 : lo;
+		aatree_range(tree, &iterator, (void*)lo, (void*)hi);
+		while((node = aatree_iterator_next(&iterator))) {
+			while(!present[next])
+				++next;
+			assert((intptr_t)node->value == next++);
+		}
+		while(next <= hi && next < 1024)
+			assert(!present[next++]);
+	}
+	aatree_destroy(tree);
+
+	// intrusive tree links caller owned nodes and never allocates
+	static struct item items[1024];
+	tree = aatree_create_intrusive(item_compare);
+	for(int i = 0; i < 1024; ++i)
+		items[i].key = i;
+	for(int i = 0; i < 200000; ++i) {
+		struct item* item = &items[rand() % 1024];
+		struct item key = { .key = item->key };
+		struct aatree_node* found = aatree_find_node(tree, &key.node);
+		if(rand() % 2) {
+			assert(aatree_insert_node(tree, &item->node) == (found ? 1 : 0));
+		} else {
+			assert(aatree_remove_node(tree, &key.node) == found);
+			assert(!found || found == &item->node);
+		}
+		if(i % 1000 == 0)
+			assert(aatree_node_check_levels(tree, tree->root) == tree->size);
+	}
+	int prev = -1;
+	aatree_iterate_foward(tree, check_item_order, &prev);
+	for(int counted = 0; counted < 2; ++counted) {
+		// in order walks first, then the same answers from the counts
+		if(counted)
+			aatree_enable_counts(tree);
+		assert(aatree_node_check_levels(tree, tree->root) == tree->size);
+		for(size_t k = 0; k < tree->size; ++k) {
+			struct aatree_node* node = (struct aatree_node*)aatree_select(tree, k);
+			assert(aatree_rank_node(tree, node) == k);
+		}
+		assert(aatree_select(tree, tree->size) == NULL);
+	}
+	struct item lo = { .key = 100 }, hi = { .key = 200 };
+	prev = 99;
+	aatree_range_node(tree, &iterator, &lo.node, &hi.node);
+	for(struct aatree_node* node; (node = aatree_iterator_next(&iterator)); ) {
+		struct item* item = aatree_entry(node, struct item, node);
+		assert(item->key > prev && item->key <= 200);
+		prev = item->key;
+		assert(aatree_lower_bound_node(tree, node) == node);
+	}
+	aatree_range_node(tree, &iterator, NULL, NULL);
+	for(size_t k = 0; k < tree->size; ++k)
+		assert(aatree_iterator_next(&iterator) == aatree_select(tree, k));
+	assert(aatree_iterator_next(&iterator) == NULL);
+	assert(aatree_node_check_levels(tree, tree->root) == tree->size);
+	assert(tree->priv.slabs == NULL);
+	aatree_destroy(tree);
+
+	// bulk construction gives valid trees of every size
+	void** values = (void**)malloc(1000000 * sizeof(void*));
+	for(intptr_t i = 0; i < 1000000; ++i)
+		values[i] = (void*)(i * 2);
+	for(size_t size = 0; size < 300; ++size) {
+		tree = aatree_build_sorted(int_compare, values, size);
+		assert(aatree_node_check(tree, tree->root, -1, 600) == size && tree->size == size);
+		aatree_insert(tree, (void*)(intptr_t)1);
+		aatree_remove(tree, (void*)(intptr_t)0);
+		assert(aatree_node_check(tree, tree->root, -1, 600) == tree->size);
+		aatree_destroy(tree);
+	}
+	values[1] = values[0];
+	assert(aatree_build_sorted(int_compare, values, 2) == NULL);
+	values[1] = (void*)(intptr_t)2;
+
+	b = clock();
+	tree = aatree_build_sorted(int_compare, values, 1000000);
+	e = clock();
+	printf("[BUILD] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	assert(aatree_node_check(tree, tree->root, -1, 2000000) == 1000000);
+
+	// set operations against each other: evens and multiples of three
+	aatree_enable_counts(tree);
+	for(intptr_t i = 0; i < 1000000; ++i)
+		values[i] = (void*)(i * 3);
+	struct aatree* other = aatree_build_sorted(int_compare, values, 1000000);
+	b = clock();
+	struct aatree* merged = aatree_union(tree, other);
+	e = clock();
+	printf("[UNION] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	assert(aatree_node_check(merged, merged->root, -1, 3000000) == merged->size);
+	assert(merged->size == 1000000 + 1000000 - (1000000 / 3 + 1));
+	for(intptr_t i = 1; i < 3000000; i += 7)
+		assert((aatree_find(merged, (void*)i) != NULL) == ((i < 2000000 && i % 2 == 0) || i % 3 == 0));
+	aatree_destroy(merged);
+
+	merged = aatree_intersection(tree, other);
+	assert(aatree_node_check(merged, merged->root, -1, 3000000) == merged->size);
+	assert(merged->size == 1000000 / 3 + 1 && merged->counted);
+	assert((intptr_t)aatree_select(merged, 5) == 30);
+	aatree_destroy(merged);
+
+	merged = aatree_difference(tree, other);
+	assert(aatree_node_check(merged, merged->root, -1, 3000000) == merged->size);
+	assert(merged->size == 1000000 - (1000000 / 3 + 1));
+	assert((intptr_t)aatree_select(merged, 0) == 2 && (intptr_t)aatree_select(merged, 2) == 8);
+	aatree_destroy(merged);
+
+	merged = aatree_difference(tree, tree);
+	assert(merged->size == 0);
+	aatree_destroy(merged);
+	aatree_destroy(other);
+	aatree_destroy(tree);
+	free(values);
+
+	// an empty tree owns no slab
+	tree = aatree_create(int_compare);
+	assert(tree->priv.slabs == NULL);
 	aatree_destroy(tree);
 
 	tree = aatree_create(int_compare);
@@ -28,31 +28,62 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 typedef int (*aatree_compare)(void* lhs, void* rhs);
 
+/**
+ * maximum height of a tree, an AA tree of n nodes is at most 2 * log2(n + 1)
+ * high and 32-byte nodes in a 48-bit address space keep n below 2^43
+ */
+#define AATREE_MAX_HEIGHT 96
+
+struct aatree_slab;
+
 struct aatree_node {
 	void* value;
 	struct aatree_node* left;
 	struct aatree_node* right;
 	int level;
+	uint32_t count;		// number of nodes in this subtree on counted trees, fits in what used to be padding
 };
 
+typedef int (*aatree_node_compare)(struct aatree_node* lhs, struct aatree_node* rhs);
+
+/**
+ * Get the structure embedding an intrusive node
+ */
+#define aatree_entry(node, type, member) ((type*)((char*)(node) - offsetof(type, member)))
+
 struct aatree {
 	struct aatree_node* root;
 	size_t size;
 	aatree_compare compare;
+	aatree_node_compare node_compare;	// set on intrusive trees only
+	bool counted;						// subtree counts are kept, see aatree_enable_counts()
 
 	struct {
-		int error;
-		void* removed_value;
-		int remove_performed;
 		struct aatree_node bottom;
-		struct aatree_node* deleted;
-		struct aatree_node* last;
+		struct aatree_slab* slabs;			// node slabs, newest first
+		struct aatree_node* free_nodes;		// released nodes, linked through left
+		size_t slab_used;					// nodes handed out from the newest slab
 	} priv;
 };
 
+/**
+ * Cursor over a range of a tree
+ *
+ * The iterator keeps the nodes still to be visited on its own stack instead
+ * of recursing. The tree must not be modified while an iterator is in use.
+ */
+struct aatree_iterator {
+	struct aatree* tree;
+	struct aatree_node* hi;		// inclusive upper bound, NULL for none
+	struct aatree_node hi_key;	// storage for the upper bound of aatree_range()
+	int depth;
+	struct aatree_node* stack[AATREE_MAX_HEIGHT];
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -60,14 +91,96 @@ extern "C" {
 struct aatree* aatree_create(aatree_compare compare);
 void aatree_destroy(struct aatree* self);
 
+/**
+ * Bulk construction
+ *
+ * aatree_build_sorted() creates a tree holding size values in O(n), without
+ * a single rotation. values must be strictly ascending by compare,
+ * otherwise NULL is returned.
+ *
+ * The set operations merge two value trees in order and build a new tree
+ * from the result in O(n + m). Both trees are left untouched and must
+ * order values alike; lhs->compare is used. When both hold an equal value
+ * the lhs one is kept. The result keeps subtree counts if lhs does.
+ * Intrusive trees are refused with NULL.
+ */
+struct aatree* aatree_build_sorted(aatree_compare compare, void** values, size_t size);
+struct aatree* aatree_union(struct aatree* lhs, struct aatree* rhs);
+struct aatree* aatree_intersection(struct aatree* lhs, struct aatree* rhs);
+struct aatree* aatree_difference(struct aatree* lhs, struct aatree* rhs);
+
 int aatree_insert(struct aatree* self, void* value);
 int aatree_remove(struct aatree* self, void* value);
 size_t aatree_size(struct aatree* self);
 
+/**
+ * Intrusive interface
+ *
+ * The caller embeds a struct aatree_node in its own structure and the tree
+ * links those nodes directly, so inserting and removing never allocate.
+ * The comparator receives nodes, use aatree_entry() to get back to the
+ * embedding structure. Searches take a key node, usually embedded in a
+ * structure on the stack with only the key fields set.
+ *
+ * A linked node's value points to the node itself, so aatree_find_min(),
+ * aatree_find_max() and the iteration callbacks hand out node pointers.
+ * Nodes stay owned by the caller, aatree_destroy() releases only the tree.
+ */
+struct aatree* aatree_create_intrusive(aatree_node_compare compare);
+int aatree_insert_node(struct aatree* self, struct aatree_node* node);
+struct aatree_node* aatree_remove_node(struct aatree* self, struct aatree_node* key);
+struct aatree_node* aatree_find_node(struct aatree* self, struct aatree_node* key);
+
 void* aatree_find(struct aatree* self, void* value);
+
+/**
+ * Bounded lookups
+ *
+ * aatree_lower_bound() returns the smallest value not less than value and
+ * aatree_upper_bound() the smallest value greater than value, NULL if none.
+ * The _node forms take and return nodes, for intrusive trees.
+ */
+void* aatree_lower_bound(struct aatree* self, void* value);
+void* aatree_upper_bound(struct aatree* self, void* value);
+struct aatree_node* aatree_lower_bound_node(struct aatree* self, struct aatree_node* key);
+struct aatree_node* aatree_upper_bound_node(struct aatree* self, struct aatree_node* key);
+
+/**
+ * Range iteration
+ *
+ * aatree_range() positions iterator on the values in [lo, hi], then each
+ * aatree_iterator_next() returns the node holding the next value in
+ * ascending order, NULL past hi. Only the nodes in range and the paths
+ * leading to them are visited.
+ *
+ * aatree_range_node() takes key nodes instead, NULL meaning unbounded.
+ * hi must stay valid while the iterator is in use.
+ */
+void aatree_range(struct aatree* self, struct aatree_iterator* iterator, void* lo, void* hi);
+void aatree_range_node(struct aatree* self, struct aatree_iterator* iterator, struct aatree_node* lo, struct aatree_node* hi);
+struct aatree_node* aatree_iterator_next(struct aatree_iterator* iterator);
 void* aatree_find_min(struct aatree* self);
 void* aatree_find_max(struct aatree* self);
 
+/**
+ * Order statistics
+ *
+ * aatree_select() returns the k-th smallest value counting from 0, NULL if k is out of range.
+ * aatree_rank() returns the number of values smaller than value, which is
+ * the index of value when present. aatree_rank_node() is the intrusive form.
+ *
+ * Both walk the tree in order, O(n), unless aatree_enable_counts() made
+ * every node count the nodes of its subtree: then they run in O(log n) and
+ * each insertion and removal pays a few more stores per level to keep the
+ * counts. Enabling takes O(n) on a populated tree and fails with nonzero
+ * past UINT32_MAX elements, as counts are 32-bit; a counted tree refuses
+ * insertions past that. Trees start without counts.
+ */
+int aatree_enable_counts(struct aatree* self);
+void* aatree_select(struct aatree* self, size_t k);
+size_t aatree_rank(struct aatree* self, void* value);
+size_t aatree_rank_node(struct aatree* self, struct aatree_node* key);
+
 typedef void (*aatree_iteration_callback)(struct aatree* self, void* value, void* callback_context);
 void aatree_iterate_foward(struct aatree* self, aatree_iteration_callback callback, void* callback_context);
 void aatree_iterate_backward(struct aatree* self, aatree_iteration_callback callback, void* callback_context);
@@ -35,816 +35,3795 @@
  *  Last modified: 17 June 2016
  */
 
+#include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "bpt.h"
 
-typedef struct bpt_record {
-	void*	value;
-} record;
-typedef struct bpt_node node;
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BPT_SEARCH_WIDTH 32
+#elif defined(__SSE4_2__)
+#include <nmmintrin.h>
+#define BPT_SEARCH_WIDTH 16
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define BPT_SEARCH_WIDTH 16
+#else
+#define BPT_SEARCH_WIDTH 8
+#endif
+
+/* Lookups a batched search keeps in flight at once. */
+#define BPT_BATCH_GROUP 32
+
+#define BPT_FILE_MAGIC "BPTFILE1"
+#define BPT_FILE_VERSION 1
+
+/* Key arrays of a page are padded to the widest search chunk of any
+ * build, so files stay readable whatever instruction set wrote them.
+ */
+#define BPT_PAGE_KEYS_ALIGN 32
 
+#define BPT_LOG_MAGIC "BPTLOG01"
+#define BPT_LOG_VERSION 1
 
-// order determines the maximum and minimum number of entries (keys and pointers) in any
-// node.  Every node has at most order - 1 keys and at least half thath number
-int order = 16; // this MUST be at least 3
+/* Initial capacity of the log buffer, which doubles as records pile up. */
+#define BPT_LOG_BUFFER 4096
 
-// Utility.
-int find_range(node* root, int key_start, int key_end, bool verbose,
-		int returned_keys[], void* returned_pointers[]);
-node* find_leaf(node* root, int key);
-record* find(node* root, int key, bool verbose);
-int cut(int length);
+/* Page file loaded by bpt_open_logged() is packed to this fill factor,
+ * leaving room in every node for the writes that follow.
+ */
+#define BPT_LOG_FILL_FACTOR 0.75
+
+/* Page 0 of a saved tree. */
+struct bpt_file_header {
+	char		magic[8];
+	uint32_t	version;
+	int32_t		order;
+	uint32_t	key_type;
+	uint32_t	reserved;
+	uint64_t	key_size;
+	uint64_t	page_size;
+	uint64_t	num_pages;	// including the header page
+	uint64_t	root;		// 0 for an empty tree
+	uint64_t	size;
+};
+
+/* Start of a write-ahead log. */
+struct bpt_log_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	key_type;
+	uint64_t	key_size;
+};
+
+enum bpt_log_op {
+	BPT_LOG_PUT = 1,
+	BPT_LOG_REMOVE,
+	BPT_LOG_REMOVE_RANGE,
+};
+
+/* Every log record starts with this header, followed by its key and, for
+ * BPT_LOG_REMOVE_RANGE, the range end.  The checksum covers the rest of
+ * the record, so a record torn by a crash is told from a complete one.
+ */
+struct bpt_log_record {
+	uint32_t	checksum;
+	uint32_t	op;
+	uint64_t	value;
+};
+
+struct bpt_log {
+	int		fd;
+	char*	path;		// page file
+	char*	buffer;		// records not written yet
+	size_t	used;
+	size_t	capacity;
+	size_t	pending;	// records in buffer
+	size_t	group_size;
+	off_t	end;		// log size up to the last committed record
+	bool	torn;		// bytes past end could not be cut off yet
+	bool	lost;		// a record could not be buffered, the log stops at the last commit
+};
 
-// Insertion.
-node* make_node(bool is_leaf);
-int get_left_index(node* parent, node* left);
-node* insert_into_leaf(node* leaf, int key, record* pointer);
-node* insert_into_leaf_after_splitting(node* root, node* leaf, int key,
-		record* pointer);
-node* insert_into_node(node* root, node* parent, int left_index, int key,
-		node* right);
-node* insert_into_node_after_splitting(node* root, node* parent, int left_index,
-		int key, node* right);
-node* insert_into_parent(node* root, node* left, int key, node* right);
-node* insert_into_new_root(node* left, int key, node* right);
-node* start_new_tree(int key, record* pointer);
-node* insert(node* root, int key, void* value);
+typedef struct bpt_record {
+	void*	value;
+} record;
+typedef struct bpt_node node;
 
-// Deletion.
-int get_neighbor_index(node* n);
-node* adjust_root(node* root);
-node* coalesce_nodes(node* root, node* n, node* neighbor, int neighbor_index,
-		int k_prime);
-node* redistribute_nodes(node* root, node* n, node* neighbor,
-		int neighbor_index, int k_prime_index, int k_prime);
-node* delete_entry(node* root, node* n, int key, void* pointer);
-node* delete (node* root, int key);
-
-/* Finds keys and their pointers, if present, in the range specified
- * by key_start and key_end, inclusive.  Places these in the arrays
- * returned_keys and returned_pointers, and returns the number of
- * entries found.
- */
-int find_range(node* root, int key_start, int key_end, bool verbose,
-		int returned_keys[/*key_end-key_start+1*/], void* returned_pointers[/*key_end-key_start+1*/]) {
-	node* n = find_leaf(root, key_start);
-	if(n == NULL)
-		return 0;
+/* Nodes other than the root have at least two children,
+ * so no tree addressable in memory is deeper than this.
+ */
+#define BPT_MAX_HEIGHT 64
 
-	int i, num_found;
-	num_found = 0;
-	for(i = 0; i < n->num_keys && n->keys[i] < key_start; i++);
-	if(i == n->num_keys)
-		return 0;
+/* Root to leaf path of one descent: the node at each
+ * level and, above the last one, the index of the child
+ * taken.  Mutations descend once and walk back up this
+ * stack instead of following parent pointers.
+ */
+struct path {
+	node*	nodes[BPT_MAX_HEIGHT];
+	int		slots[BPT_MAX_HEIGHT];
+	int		depth;	// level of the last node
+};
+
+// KEYS.
+
+/* Keys are stored back to back, key_size bytes each, in the key array of a
+ * node. Every key access goes through the helpers below; they switch on the
+ * key type, which the compiler turns into a well predicted branch around
+ * inlined integer code instead of an indirect call per comparison.
+ */
+static inline void* key_at(struct bpt* self, node* n, int i) {
+	return n->keys + (size_t)i * self->key_size;
+}
 
-	while(n != NULL) {
-		for(; i < n->num_keys && n->keys[i] <= key_end; i++) {
-			returned_keys[num_found] = n->keys[i];
-			returned_pointers[num_found] = n->pointers[i];
-			num_found++;
-		}
-		n = n->pointers[order - 1];
-		i = 0;
+static inline void key_copy(struct bpt* self, void* dst, const void* src) {
+	switch(self->key_type) {
+	case BPT_KEY_INT32:
+		*(int32_t*)dst = *(const int32_t*)src;
+		break;
+	case BPT_KEY_INT64:
+	case BPT_KEY_UINT64:
+		*(int64_t*)dst = *(const int64_t*)src;
+		break;
+	default:
+		memcpy(dst, src, self->key_size);
 	}
-
-	return num_found;
 }
 
-node* find_leaf(node* root, int key) {
-	if(root == NULL)
-		return NULL;
+/* Moves count keys of n from index src to index dst, overlapping or not. */
+static inline void key_move(struct bpt* self, node* n, int dst, int src, int count) {
+	if(count > 0)
+		memmove(key_at(self, n, dst), key_at(self, n, src), (size_t)count * self->key_size);
+}
 
-	node* c = root;
-	while(!c->is_leaf) {
-		int i = 0;
-		while(i < c->num_keys) {
-			if(key >= c->keys[i])
-				i++;
-			else
-				break;
-		}
-		c = (node*)c->pointers[i];
+static inline int key_compare(struct bpt* self, const void* lhs, const void* rhs) {
+	switch(self->key_type) {
+	case BPT_KEY_INT32: {
+		int32_t a = *(const int32_t*)lhs, b = *(const int32_t*)rhs;
+		return (a > b) - (a < b);
+	}
+	case BPT_KEY_INT64: {
+		int64_t a = *(const int64_t*)lhs, b = *(const int64_t*)rhs;
+		return (a > b) - (a < b);
+	}
+	case BPT_KEY_UINT64: {
+		uint64_t a = *(const uint64_t*)lhs, b = *(const uint64_t*)rhs;
+		return (a > b) - (a < b);
+	}
+	case BPT_KEY_BINARY:
+		return memcmp(lhs, rhs, self->key_size);
+	default:
+		return self->compare((void*)lhs, (void*)rhs);
 	}
+}
 
-	return c;
+// NODE SEARCH.
+
+/* Rank of key among the sorted keys of a node:
+ * rank_lt counts keys less than key (the slot key belongs to in a leaf),
+ * rank_le counts keys less than or equal to key (the child to descend into).
+ * Integer key types get kernels specialized per type: the scalar loops are
+ * generated by BPT_DEFINE_SCALAR_RANK, and the vector kernels compare a
+ * BPT_SEARCH_WIDTH byte chunk of keys per instruction, mask off lanes past
+ * num_keys and, keys being sorted, find the rank as the first clear bit of
+ * the movemask. Key arrays are padded to BPT_SEARCH_WIDTH bytes so the last
+ * load stays inside the node block.
+ */
+#define BPT_DEFINE_SCALAR_RANK(suffix, type) \
+static inline int rank_lt_##suffix##_scalar(const type* keys, int num_keys, type key) { \
+	int i = 0; \
+	while(i < num_keys && keys[i] < key) \
+		i++; \
+	return i; \
+} \
+\
+static inline int rank_le_##suffix##_scalar(const type* keys, int num_keys, type key) { \
+	int i = 0; \
+	while(i < num_keys && keys[i] <= key) \
+		i++; \
+	return i; \
 }
 
-/* Finds and returns the record to which a key refers. */
-record* find(node* root, int key, bool verbose) {
-	node* leaf = find_leaf(root, key);
-	if(leaf == NULL)
-		return NULL;
+BPT_DEFINE_SCALAR_RANK(int32, int32_t)
+BPT_DEFINE_SCALAR_RANK(int64, int64_t)
+BPT_DEFINE_SCALAR_RANK(uint64, uint64_t)
+
+#if BPT_SEARCH_WIDTH == 32
+static inline int rank_lt_int32(const int32_t* keys, int num_keys, int32_t key) {
+	__m256i needle = _mm256_set1_epi32(key);
+	for(int i = 0; i < num_keys; i += 8) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i*)(keys + i));
+		unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(needle, chunk)));
+		if(num_keys - i < 8)
+			mask &= (1u << (num_keys - i)) - 1;
+		if(mask != 0xff)
+			return i + __builtin_ctz(~mask);
+	}
+	return num_keys;
+}
 
-	int i;
-	for(i = 0; i < leaf->num_keys; i++)
-		if(leaf->keys[i] == key)
-			break;
+static inline int rank_le_int32(const int32_t* keys, int num_keys, int32_t key) {
+	__m256i needle = _mm256_set1_epi32(key);
+	for(int i = 0; i < num_keys; i += 8) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i*)(keys + i));
+		unsigned mask = ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(chunk, needle))) & 0xff;
+		if(num_keys - i < 8)
+			mask &= (1u << (num_keys - i)) - 1;
+		if(mask != 0xff)
+			return i + __builtin_ctz(~mask);
+	}
+	return num_keys;
+}
 
-	return i == leaf->num_keys ? NULL : (record*)leaf->pointers[i];
+/* Unsigned keys are compared as signed ones after flipping the sign bit. */
+#define BPT_DEFINE_RANK64(suffix, type, bias) \
+static inline int rank_lt_##suffix(const type* keys, int num_keys, type key) { \
+	__m256i flip = _mm256_set1_epi64x(bias); \
+	__m256i needle = _mm256_xor_si256(_mm256_set1_epi64x((int64_t)key), flip); \
+	for(int i = 0; i < num_keys; i += 4) { \
+		__m256i chunk = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(keys + i)), flip); \
+		unsigned mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(needle, chunk))); \
+		if(num_keys - i < 4) \
+			mask &= (1u << (num_keys - i)) - 1; \
+		if(mask != 0xf) \
+			return i + __builtin_ctz(~mask); \
+	} \
+	return num_keys; \
+} \
+\
+static inline int rank_le_##suffix(const type* keys, int num_keys, type key) { \
+	__m256i flip = _mm256_set1_epi64x(bias); \
+	__m256i needle = _mm256_xor_si256(_mm256_set1_epi64x((int64_t)key), flip); \
+	for(int i = 0; i < num_keys; i += 4) { \
+		__m256i chunk = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(keys + i)), flip); \
+		unsigned mask = ~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(chunk, needle))) & 0xf; \
+		if(num_keys - i < 4) \
+			mask &= (1u << (num_keys - i)) - 1; \
+		if(mask != 0xf) \
+			return i + __builtin_ctz(~mask); \
+	} \
+	return num_keys; \
 }
 
-/* Finds the appropriate place to split a node that is too big into two. */
-int cut(int length) {
-	/* return length % 2 == 0 ? length / 2 : length / 2 + 1; */
-	return (length / 2) + (length % 2);
+BPT_DEFINE_RANK64(int64, int64_t, 0)
+BPT_DEFINE_RANK64(uint64, uint64_t, INT64_MIN)
+#elif BPT_SEARCH_WIDTH == 16
+static inline int rank_lt_int32(const int32_t* keys, int num_keys, int32_t key) {
+	__m128i needle = _mm_set1_epi32(key);
+	for(int i = 0; i < num_keys; i += 4) {
+		__m128i chunk = _mm_loadu_si128((const __m128i*)(keys + i));
+		unsigned mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(needle, chunk)));
+		if(num_keys - i < 4)
+			mask &= (1u << (num_keys - i)) - 1;
+		if(mask != 0xf)
+			return i + __builtin_ctz(~mask);
+	}
+	return num_keys;
 }
 
-// INSERTION
+static inline int rank_le_int32(const int32_t* keys, int num_keys, int32_t key) {
+	__m128i needle = _mm_set1_epi32(key);
+	for(int i = 0; i < num_keys; i += 4) {
+		__m128i chunk = _mm_loadu_si128((const __m128i*)(keys + i));
+		unsigned mask = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(chunk, needle))) & 0xf;
+		if(num_keys - i < 4)
+			mask &= (1u << (num_keys - i)) - 1;
+		if(mask != 0xf)
+			return i + __builtin_ctz(~mask);
+	}
+	return num_keys;
+}
 
-/* Creates a new general node, which can be adapted to serve as either a leaf or an internal node. */
-node* make_node(bool is_leaf) {
-	node* new_node = calloc(1, sizeof(node));
-	if(new_node == NULL)
-		return NULL;
+#if defined(__SSE4_2__)
+/* Unsigned keys are compared as signed ones after flipping the sign bit. */
+#define BPT_DEFINE_RANK64(suffix, type, bias) \
+static inline int rank_lt_##suffix(const type* keys, int num_keys, type key) { \
+	__m128i flip = _mm_set1_epi64x(bias); \
+	__m128i needle = _mm_xor_si128(_mm_set1_epi64x((int64_t)key), flip); \
+	for(int i = 0; i < num_keys; i += 2) { \
+		__m128i chunk = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(keys + i)), flip); \
+		unsigned mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(needle, chunk))); \
+		if(num_keys - i < 2) \
+			mask &= 1; \
+		if(mask != 0x3) \
+			return i + __builtin_ctz(~mask); \
+	} \
+	return num_keys; \
+} \
+\
+static inline int rank_le_##suffix(const type* keys, int num_keys, type key) { \
+	__m128i flip = _mm_set1_epi64x(bias); \
+	__m128i needle = _mm_xor_si128(_mm_set1_epi64x((int64_t)key), flip); \
+	for(int i = 0; i < num_keys; i += 2) { \
+		__m128i chunk = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(keys + i)), flip); \
+		unsigned mask = ~_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(chunk, needle))) & 0x3; \
+		if(num_keys - i < 2) \
+			mask &= 1; \
+		if(mask != 0x3) \
+			return i + __builtin_ctz(~mask); \
+	} \
+	return num_keys; \
+}
 
-	new_node->keys = malloc((order - 1) * sizeof(int));
-	if(new_node->keys == NULL) {
-		free(new_node);
-		return NULL;
+BPT_DEFINE_RANK64(int64, int64_t, 0)
+BPT_DEFINE_RANK64(uint64, uint64_t, INT64_MIN)
+#else
+#define rank_lt_int64 rank_lt_int64_scalar
+#define rank_le_int64 rank_le_int64_scalar
+#define rank_lt_uint64 rank_lt_uint64_scalar
+#define rank_le_uint64 rank_le_uint64_scalar
+#endif
+#else
+#define rank_lt_int32 rank_lt_int32_scalar
+#define rank_le_int32 rank_le_int32_scalar
+#define rank_lt_int64 rank_lt_int64_scalar
+#define rank_le_int64 rank_le_int64_scalar
+#define rank_lt_uint64 rank_lt_uint64_scalar
+#define rank_le_uint64 rank_le_uint64_scalar
+#endif
+
+/* Binary and comparator keys are too wide to vectorize; a binary search
+ * keeps the number of memcmp or callback invocations logarithmic.
+ * strict selects rank_lt (true) or rank_le (false).
+ */
+static inline int rank_generic(struct bpt* self, const char* keys, int num_keys, const void* key,
+		bool strict) {
+	int lo = 0, hi = num_keys;
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		int c = key_compare(self, keys + (size_t)mid * self->key_size, key);
+		if(c < 0 || (!strict && c == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	return lo;
+}
 
-	new_node->pointers = malloc(order * sizeof(void*));
-	if(new_node->pointers == NULL) {
-		free(new_node->keys);
-		free(new_node);
-		return NULL;
+static inline int keys_rank_lt(struct bpt* self, const char* keys, int num_keys, const void* key) {
+	switch(self->key_type) {
+	case BPT_KEY_INT32:
+		return rank_lt_int32((const int32_t*)keys, num_keys, *(const int32_t*)key);
+	case BPT_KEY_INT64:
+		return rank_lt_int64((const int64_t*)keys, num_keys, *(const int64_t*)key);
+	case BPT_KEY_UINT64:
+		return rank_lt_uint64((const uint64_t*)keys, num_keys, *(const uint64_t*)key);
+	default:
+		return rank_generic(self, keys, num_keys, key, true);
 	}
-
-	new_node->is_leaf = is_leaf;
-	return new_node;
 }
 
-/* Helper function used in insert_into_parent
- * to find the index of the parent's pointer to
- * the node to the left of the key to be inserted.
- */
-int get_left_index(node* parent, node* left) {
-	int left_index = 0;
-	while(left_index <= parent->num_keys && parent->pointers[left_index] != left)
-		left_index++;
-	return left_index;
+static inline int keys_rank_le(struct bpt* self, const char* keys, int num_keys, const void* key) {
+	switch(self->key_type) {
+	case BPT_KEY_INT32:
+		return rank_le_int32((const int32_t*)keys, num_keys, *(const int32_t*)key);
+	case BPT_KEY_INT64:
+		return rank_le_int64((const int64_t*)keys, num_keys, *(const int64_t*)key);
+	case BPT_KEY_UINT64:
+		return rank_le_uint64((const uint64_t*)keys, num_keys, *(const uint64_t*)key);
+	default:
+		return rank_generic(self, keys, num_keys, key, false);
+	}
 }
 
-/* Inserts a new pointer to a record and its corresponding
- * key into a leaf.
- * Returns the altered leaf.
+/* Binary keys are typically strings, such as URLs, sharing long prefixes
+ * with the other keys of their node.  Their node block stores that prefix
+ * once and, in place of the keys, a head per key: the 8 bytes following the
+ * prefix as a big endian integer, zero padded past the key end, which orders
+ * heads like the keys.  The full keys live in a block of their own.  A
+ * search compares the prefix once, ranks the heads with the uint64 kernels
+ * and reads full keys only among those whose head ties with its own, so a
+ * descent touches 8 bytes per key of each node instead of key_size.
+ * node_update_heads() rebuilds prefix and heads after a node is split,
+ * merged or refilled, node_insert_head() and node_remove_head() shift them
+ * after a single key moves in or out.
  */
-node* insert_into_leaf(node* leaf, int key, record* pointer) {
-	int i, insertion_point;
+static inline uint64_t* node_heads(node* n) {
+	return (uint64_t*)(n + 1);
+}
 
-	insertion_point = 0;
-	while(insertion_point < leaf->num_keys && leaf->keys[insertion_point] < key)
-		insertion_point++;
+static size_t node_keys_offset(struct bpt* self);
 
-	for(i = leaf->num_keys; i > insertion_point; i--) {
-		leaf->keys[i] = leaf->keys[i - 1];
-		leaf->pointers[i] = leaf->pointers[i - 1];
-	}
-	leaf->keys[insertion_point] = key;
-	leaf->pointers[insertion_point] = pointer;
-	leaf->num_keys++;
-	return leaf;
+static inline char* node_prefix(struct bpt* self, node* n) {
+	return (char*)n + node_keys_offset(self);
 }
 
-/* Inserts a new key and pointer
- * to a new record into a leaf so as to exceed
- * the tree's order, causing the leaf to be split
- * in half.
- */
-node* insert_into_leaf_after_splitting(node* root, node* leaf, int key,
-		record* pointer) {
-	node* new_leaf;
-	int* temp_keys;
-	void** temp_pointers;
-	int insertion_index, split, new_key, i, j;
+static inline uint64_t key_head(struct bpt* self, const char* key, size_t prefix) {
+	uint64_t head = 0;
+	if(prefix < self->key_size)
+		memcpy(&head, key + prefix, self->key_size - prefix < 8 ? self->key_size - prefix : 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	head = __builtin_bswap64(head);
+#endif
+	return head;
+}
 
-	new_leaf = make_node(true);
+static void node_update_heads(struct bpt* self, node* n) {
+	if(self->key_type != BPT_KEY_BINARY)
+		return;
 
-	temp_keys = malloc(order * sizeof(int));
-	if(temp_keys == NULL) {
-		perror("Temporary keys array.");
-		exit(EXIT_FAILURE);
+	size_t prefix = 0;
+	if(n->num_keys > 0) {
+		const char* first = key_at(self, n, 0);
+		const char* last = key_at(self, n, n->num_keys - 1);
+		while(prefix < self->key_size && prefix < UINT16_MAX && first[prefix] == last[prefix])
+			prefix++;
+		memcpy(node_prefix(self, n), first, prefix);
 	}
+	n->prefix_len = prefix;
 
-	temp_pointers = malloc(order * sizeof(void*));
-	if(temp_pointers == NULL) {
-		perror("Temporary pointers array.");
-		exit(EXIT_FAILURE);
+	uint64_t* heads = node_heads(n);
+	for(int i = 0; i < n->num_keys; i++)
+		heads[i] = key_head(self, key_at(self, n, i), prefix);
+}
+
+/* A key inserted between the first and the last shares their prefix,
+ * only the heads past it shift.  A new first or last key may shorten
+ * the prefix and rebuilds them all.
+ */
+static void node_insert_head(struct bpt* self, node* n, int index) {
+	if(self->key_type != BPT_KEY_BINARY)
+		return;
+	if(index == 0 || index == n->num_keys - 1) {
+		node_update_heads(self, n);
+		return;
 	}
 
-	insertion_index = 0;
-	while(insertion_index < order - 1 && leaf->keys[insertion_index] < key)
-		insertion_index++;
+	uint64_t* heads = node_heads(n);
+	memmove(&heads[index + 1], &heads[index], (n->num_keys - 1 - index) * sizeof(uint64_t));
+	heads[index] = key_head(self, key_at(self, n, index), n->prefix_len);
+}
 
-	for(i = 0, j = 0; i < leaf->num_keys; i++, j++) {
-		if(j == insertion_index) j++;
-		temp_keys[j] = leaf->keys[i];
-		temp_pointers[j] = leaf->pointers[i];
+/* Same for a removed key, whose removal may lengthen the prefix only if it was the first or the last. */
+static void node_remove_head(struct bpt* self, node* n, int index) {
+	if(self->key_type != BPT_KEY_BINARY)
+		return;
+	if(index == 0 || index == n->num_keys) {
+		node_update_heads(self, n);
+		return;
 	}
 
-	temp_keys[insertion_index] = key;
-	temp_pointers[insertion_index] = pointer;
+	uint64_t* heads = node_heads(n);
+	memmove(&heads[index], &heads[index + 1], (n->num_keys - index) * sizeof(uint64_t));
+}
 
-	leaf->num_keys = 0;
+static inline int rank_heads(struct bpt* self, node* n, const void* key, bool strict) {
+	size_t prefix = n->prefix_len;
+	if(n->num_keys == 0)
+		return 0;
 
-	split = cut(order - 1);
+	int c = memcmp(key, node_prefix(self, n), prefix);
+	if(c != 0)
+		return c < 0 ? 0 : n->num_keys;
+
+	const uint64_t* heads = node_heads(n);
+	uint64_t head = key_head(self, key, prefix);
+	int lo = rank_lt_uint64(heads, n->num_keys, head);
+	int hi = lo;
+	while(hi < n->num_keys && heads[hi] == head)
+		hi++;
+	if(lo == hi || prefix + 8 >= self->key_size)
+		return strict ? lo : hi;
+	return lo + rank_generic(self, key_at(self, n, lo), hi - lo, key, strict);
+}
 
-	for(i = 0; i < split; i++) {
-		leaf->pointers[i] = temp_pointers[i];
-		leaf->keys[i] = temp_keys[i];
-		leaf->num_keys++;
-	}
+static inline int node_rank_lt(struct bpt* self, node* n, const void* key) {
+	if(self->key_type == BPT_KEY_BINARY)
+		return rank_heads(self, n, key, true);
+	return keys_rank_lt(self, n->keys, n->num_keys, key);
+}
 
-	for(i = split, j = 0; i < order; i++, j++) {
-		new_leaf->pointers[j] = temp_pointers[i];
-		new_leaf->keys[j] = temp_keys[i];
-		new_leaf->num_keys++;
-	}
+static inline int node_rank_le(struct bpt* self, node* n, const void* key) {
+	if(self->key_type == BPT_KEY_BINARY)
+		return rank_heads(self, n, key, false);
+	return keys_rank_le(self, n->keys, n->num_keys, key);
+}
 
-	free(temp_pointers);
-	free(temp_keys);
+// Utility.
+static size_t node_pointers_offset(struct bpt* self);
+static size_t node_block_size(struct bpt* self);
+static node* find_leaf(struct bpt* self, void* key);
+static node* find_path(struct bpt* self, void* key, struct path* path);
+static node* first_leaf(struct bpt* self);
+static node* next_leaf(struct bpt* self, node* leaf);
+static node* last_leaf(struct bpt* self);
+static node* prev_leaf(struct bpt* self, node* leaf);
+static void** find(struct bpt* self, void* key);
+static void find_leaf_batch(struct bpt* self, char* keys, size_t count, node** leaves);
+static int cut(int length);
 
-	new_leaf->pointers[order - 1] = leaf->pointers[order - 1];
-	leaf->pointers[order - 1] = new_leaf;
+// Insertion.
+static node* make_node(struct bpt* self, bool is_leaf);
+static void insert_into_leaf(struct bpt* self, node* leaf, int insertion_point, void* key,
+		void* pointer);
+static bool insert_into_leaf_after_splitting(struct bpt* self, struct path* path,
+		int insertion_index, void* key, void* pointer);
+static void insert_into_node(struct bpt* self, node* parent, int left_index, void* key,
+		node* right);
+static void insert_into_node_after_splitting(struct bpt* self, struct path* path, int level,
+		int left_index, void* key, node* right);
+static void insert_into_parent(struct bpt* self, struct path* path, int level, void* key,
+		node* right);
+static void insert_into_new_root(struct bpt* self, node* left, void* key, node* right);
+static bool start_new_tree(struct bpt* self, void* key, void* pointer);
+static bool insert(struct bpt* self, void* key, void* value);
 
-	for(i = leaf->num_keys; i < order - 1; i++) leaf->pointers[i] = NULL;
-	for(i = new_leaf->num_keys; i < order - 1; i++) new_leaf->pointers[i] = NULL;
+// Deletion.
+static void adjust_root(struct bpt* self);
+static void coalesce_nodes(struct bpt* self, struct path* path, int level, node* neighbor,
+		int neighbor_index, void* k_prime);
+static void redistribute_nodes(struct bpt* self, node* parent, node* n, node* neighbor,
+		int neighbor_index, int k_prime_index, void* k_prime);
+static void delete_entry(struct bpt* self, struct path* path, int level, int index);
+static void rebalance_node(struct bpt* self, struct path* path, int level);
+static int detach_node(struct bpt* self, struct path* path, int level);
+static node* next_leaf_on_path(struct path* path, int level);
+static int find_underfull(struct bpt* self, void* key, struct path* path);
+static size_t delete_range(struct bpt* self, void* key_start, void* key_end);
+static bool delete(struct bpt* self, void* key);
+static void destroy_tree(struct bpt* self, node* n);
+
+// Copy on write.
+static node* copy_node(struct bpt* self, node* n);
+static void own_path(struct bpt* self, struct path* path);
+static node* own_child(struct bpt* self, node* parent, int index);
+static void unshare(struct bpt* self);
+static void release_sharers(struct bpt* self);
+
+// File storage.
+static size_t page_block_size(struct bpt* self);
+static bool save_pages(struct bpt* self, FILE* file);
+static void* page_get(struct bpt* self, void* key);
+static bool page_cursor_seek(struct bpt* self, struct bpt_cursor* cursor, void* key);
+static bool page_cursor_seek_last(struct bpt* self, struct bpt_cursor* cursor, void* key);
+static bool page_cursor_next(struct bpt_cursor* self);
+static bool page_cursor_prev(struct bpt_cursor* self);
+static void* page_cursor_key(struct bpt_cursor* self);
+static void* page_cursor_value(struct bpt_cursor* self);
+
+// Write-ahead log.
+static bool save_file(struct bpt* self, const char* path, bool durable);
+static bool sync_directory(const char* path);
+static uint32_t log_checksum(const char* data, size_t size);
+static void log_append(struct bpt* self, enum bpt_log_op op, void* key, void* key_end, void* value);
+static off_t log_replay(struct bpt* self, int fd, off_t size);
+static bool log_open(struct bpt* self, const char* path, size_t group_size);
+static void log_close(struct bpt* self);
+
+// Bulk loading.
+static size_t bulk_group_size(size_t remaining, size_t per, size_t lo, size_t hi);
+static bool bulk_load(struct bpt* self, char* keys, void** values, size_t count,
+		double fill_factor);
+
+struct bpt* bpt_create(int order, unsigned flags) {
+	return bpt_create_keyed(order, flags, BPT_KEY_INT32, sizeof(int32_t), NULL);
+}
 
-	new_leaf->parent = leaf->parent;
-	new_key = new_leaf->keys[0];
+struct bpt* bpt_create_keyed(int order, unsigned flags, enum bpt_key_type key_type,
+		size_t key_size, bpt_compare compare) {
+	// order determines the maximum and minimum number of entries (keys and pointers) in any
+	// node.  Every node has at most order - 1 keys and at least half thath number
+	if(order < 3)
+		return NULL;
+
+	switch(key_type) {
+	case BPT_KEY_INT32:
+		key_size = sizeof(int32_t);
+		break;
+	case BPT_KEY_INT64:
+	case BPT_KEY_UINT64:
+		key_size = sizeof(int64_t);
+		break;
+	case BPT_KEY_BINARY:
+		if(!key_size)
+			return NULL;
+		break;
+	case BPT_KEY_COMPARE:
+		if(!key_size || !compare)
+			return NULL;
+		break;
+	default:
+		return NULL;
+	}
 
-	return insert_into_parent(root, leaf, new_key, new_leaf);
+	struct bpt* self = (struct bpt*)calloc(1, sizeof(struct bpt));
+	if(!self)
+		return NULL;
+
+	self->order = order;
+	self->flags = flags;
+	self->key_type = key_type;
+	self->key_size = key_size;
+	self->compare = compare;
+	self->node_size = node_block_size(self);
+	return self;
 }
 
-/* Inserts a new key and pointer to a node
- * into a node into which these can fit
- * without violating the B+ tree properties.
- */
-node* insert_into_node(node* root, node* n, int left_index, int key,
-		node* right) {
-	int i;
+void bpt_destroy(struct bpt* self) {
+	if(self->log)
+		log_close(self);
+	if(self->map)
+		munmap(self->map, self->map_size);
+	destroy_tree(self, self->root);
+	release_sharers(self);
+	memset(self, 0, sizeof(struct bpt)), free(self);
+}
 
-	for(i = n->num_keys; i > left_index; i--) {
-		n->pointers[i + 1] = n->pointers[i];
-		n->keys[i] = n->keys[i - 1];
-	}
-	n->pointers[left_index + 1] = right;
-	n->keys[left_index] = key;
-	n->num_keys++;
-	return root;
+size_t bpt_size(struct bpt* self) {
+	return self->size;
 }
 
-/* Inserts a new key and pointer to a node
- * into a node, causing the node's size to exceed
- * the order, and causing the node to split into two.
- */
-node* insert_into_node_after_splitting(node* root, node* old_node,
-		int left_index, int key, node* right) {
-	int i, j, split, k_prime;
-	node *new_node, *child;
-	int* temp_keys;
-	node** temp_pointers;
+bool bpt_put(struct bpt* self, void* key, void* value) {
+	if(self->map || self->frozen)
+		return false;
 
-	/* First create a temporary set of keys and pointers
-	 * to hold everything in order, including
-	 * the new key and pointer, inserted in their
-	 * correct places.
-	 * Then create a new node and copy half of the
-	 * keys and pointers to the old node and
-	 * the other half to the new.
-	 */
+	unshare(self);
+	if(!insert(self, key, value))
+		return false;
 
-	temp_pointers = malloc((order + 1) * sizeof(node*));
-	if(temp_pointers == NULL) {
-		perror("Temporary pointers array for splitting nodes.");
-		exit(EXIT_FAILURE);
-	}
-	temp_keys = malloc(order * sizeof(int));
-	if(temp_keys == NULL) {
-		perror("Temporary keys array for splitting nodes.");
-		exit(EXIT_FAILURE);
-	}
+	self->size += 1;
+	if(self->log)
+		log_append(self, BPT_LOG_PUT, key, NULL, value);
+	return true;
+}
 
-	for(i = 0, j = 0; i < old_node->num_keys + 1; i++, j++) {
-		if(j == left_index + 1) j++;
-		temp_pointers[j] = old_node->pointers[i];
-	}
+struct bpt* bpt_snapshot(struct bpt* self) {
+	if(self->map || self->flags & BPT_RECORDS)
+		return NULL;
 
-	for(i = 0, j = 0; i < old_node->num_keys; i++, j++) {
-		if(j == left_index) j++;
-		temp_keys[j] = old_node->keys[i];
+	struct bpt* snapshot = (struct bpt*)malloc(sizeof(struct bpt));
+	if(!snapshot)
+		return NULL;
+	if(self->sharers == NULL) {
+		self->sharers = (unsigned*)malloc(sizeof(unsigned));
+		if(self->sharers == NULL) {
+			free(snapshot);
+			return NULL;
+		}
+		*self->sharers = 1;
 	}
+	__atomic_add_fetch(self->sharers, 1, __ATOMIC_RELAXED);
+
+	*snapshot = *self;
+	snapshot->log = NULL;
+	snapshot->frozen = true;
+	snapshot->shared = self->shared = true;
+	if(self->root)
+		__atomic_add_fetch(&self->root->refs, 1, __ATOMIC_RELAXED);
+	return snapshot;
+}
 
-	temp_pointers[left_index + 1] = right;
-	temp_keys[left_index] = key;
+bool bpt_remove(struct bpt* self, void* key) {
+	if(self->map || self->frozen)
+		return false;
 
-	/* Create the new node and copy
-	 * half the keys and pointers to the
-	 * old and half to the new.
-	 */
-	split = cut(order);
-	new_node = make_node(false);
-	old_node->num_keys = 0;
-	for(i = 0; i < split - 1; i++) {
-		old_node->pointers[i] = temp_pointers[i];
-		old_node->keys[i] = temp_keys[i];
-		old_node->num_keys++;
-	}
-	old_node->pointers[i] = temp_pointers[i];
-	k_prime = temp_keys[split - 1];
-	for(++i, j = 0; i < order; i++, j++) {
-		new_node->pointers[j] = temp_pointers[i];
-		new_node->keys[j] = temp_keys[i];
-		new_node->num_keys++;
-	}
-	new_node->pointers[j] = temp_pointers[i];
-	free(temp_pointers);
-	free(temp_keys);
-	new_node->parent = old_node->parent;
-	for(i = 0; i <= new_node->num_keys; i++) {
-		child = new_node->pointers[i];
-		child->parent = new_node;
-	}
+	unshare(self);
+	if(!delete(self, key))
+		return false;
 
-	/* Insert a new key into the parent of the two
-	 * nodes resulting from the split, with
-	 * the old node to the left and the new to the right.
-	 */
+	self->size -= 1;
+	if(self->log)
+		log_append(self, BPT_LOG_REMOVE, key, NULL, NULL);
+	return true;
+}
 
-	return insert_into_parent(root, old_node, k_prime, new_node);
+size_t bpt_remove_range(struct bpt* self, void* key_start, void* key_end) {
+	if(self->map || self->frozen || key_compare(self, key_start, key_end) > 0)
+		return 0;
+
+	unshare(self);
+	size_t num_removed = delete_range(self, key_start, key_end);
+	self->size -= num_removed;
+	if(self->log && num_removed)
+		log_append(self, BPT_LOG_REMOVE_RANGE, key_start, key_end, NULL);
+	return num_removed;
 }
 
-/* Inserts a new node (leaf or internal node) into the B+ tree.
- * Returns the root of the tree after insertion.
- */
-node* insert_into_parent(node* root, node* left, int key, node* right) {
-	int left_index;
-	node* parent;
+void* bpt_get(struct bpt* self, void* key) {
+	if(self->map)
+		return page_get(self, key);
 
-	parent = left->parent;
+	void** slot = find(self, key);
+	if(slot == NULL)
+		return NULL;
 
-	/* Case: new root.*/
+	return self->flags & BPT_RECORDS ? ((record*)*slot)->value : *slot;
+}
 
-	if(parent == NULL) return insert_into_new_root(left, key, right);
+void** bpt_get_ref(struct bpt* self, void* key) {
+	if(self->map || self->frozen || self->log)
+		return NULL;
 
-	/* Case: leaf or node. (Remainder of
-	 * function body.)
-	 */
+	unshare(self);
+	struct path path;
+	node* leaf = find_path(self, key, &path);
+	if(leaf == NULL)
+		return NULL;
 
-	/* Find the parent's pointer to the left
-	 * node.
-	 */
+	int i = node_rank_lt(self, leaf, key);
+	if(i == leaf->num_keys || key_compare(self, key_at(self, leaf, i), key) != 0)
+		return NULL;
 
-	left_index = get_left_index(parent, left);
+	// the caller may write through the reference, so a leaf shared with a snapshot is copied first
+	own_path(self, &path);
+	void** slot = &path.nodes[path.depth]->pointers[i];
 
-	/* Simple case: the new key fits into the node.
-	*/
+	return self->flags & BPT_RECORDS ? &((record*)*slot)->value : slot;
+}
 
-	if(parent->num_keys < order - 1)
-		return insert_into_node(root, parent, left_index, key, right);
+size_t bpt_get_ranged(struct bpt* self, void* key_start, void* key_end, void** values, size_t values_size) {
+	struct bpt_cursor cursor;
+	size_t num_found = 0;
 
-	/* Harder case:  split a node in order
-	 * to preserve the B+ tree properties.
-	 */
+	bool found = bpt_cursor_seek(self, &cursor, key_start);
+	while(found && num_found < values_size && key_compare(self, bpt_cursor_key(&cursor), key_end) <= 0) {
+		values[num_found++] = bpt_cursor_value(&cursor);
+		found = bpt_cursor_next(&cursor);
+	}
 
-	return insert_into_node_after_splitting(root, parent, left_index, key, right);
+	return num_found;
 }
 
-/* Creates a new root for two subtrees
- * and inserts the appropriate key into
- * the new root.
- */
-node* insert_into_new_root(node* left, int key, node* right) {
-	node* root = make_node(false);
-	root->keys[0] = key;
-	root->pointers[0] = left;
-	root->pointers[1] = right;
-	root->num_keys++;
-	root->parent = NULL;
-	left->parent = root;
-	right->parent = root;
-	return root;
-}
+size_t bpt_get_batch(struct bpt* self, void* keys, size_t count, void** values) {
+	node* leaves[BPT_BATCH_GROUP];
+	void** slots[BPT_BATCH_GROUP];
+	char* packed_keys = (char*)keys;
+	size_t num_found = 0;
+
+	if(self->map) {
+		// page faults, not cache misses, dominate lookups in a mapped file
+		for(size_t i = 0; i < count; i++)
+			num_found += (values[i] = page_get(self, packed_keys + i * self->key_size)) != NULL;
+		return num_found;
+	}
 
-/* First insertion:
- * start a new tree.
- */
-node* start_new_tree(int key, record* pointer) {
-	node* root = make_node(true);
-	root->keys[0] = key;
-	root->pointers[0] = pointer;
-	root->pointers[order - 1] = NULL;
-	root->parent = NULL;
-	root->num_keys++;
-	return root;
-}
+	for(size_t i = 0; i < count; i += BPT_BATCH_GROUP) {
+		size_t group = count - i < BPT_BATCH_GROUP ? count - i : BPT_BATCH_GROUP;
+		char* group_keys = packed_keys + i * self->key_size;
+		find_leaf_batch(self, group_keys, group, leaves);
+
+		// value slots sit past the keys, fetch them for the whole group first
+		for(size_t j = 0; j < group; j++) {
+			void* key = group_keys + j * self->key_size;
+			node* leaf = leaves[j];
+			slots[j] = NULL;
+			if(leaf == NULL)
+				continue;
+
+			int k = node_rank_lt(self, leaf, key);
+			if(k == leaf->num_keys || key_compare(self, key_at(self, leaf, k), key) != 0)
+				continue;
+
+			slots[j] = &leaf->pointers[k];
+			__builtin_prefetch(slots[j]);
+		}
 
-/* Master insertion function.
- * Inserts a key and an associated value into
- * the B+ tree, causing the tree to be adjusted
- * however necessary to maintain the B+ tree
- * properties.
- */
-node* insert(node* root, int key, void* value) {
-	if(find(root, key, false) != NULL)
-		return root;
+		for(size_t j = 0; j < group; j++) {
+			values[i + j] = NULL;
+			if(slots[j] == NULL)
+				continue;
 
-	/* Create a new record for the value. */
-	record* pointer = (record*)malloc(sizeof(record));
-	if(pointer == NULL)
-		return root;
+			void* pointer = *slots[j];
+			values[i + j] = self->flags & BPT_RECORDS ? ((record*)pointer)->value : pointer;
+			num_found++;
+		}
+	}
 
-	pointer->value = value;
+	return num_found;
+}
 
-	if(root == NULL)
-		return start_new_tree(key, pointer);
+bool bpt_cursor_seek(struct bpt* self, struct bpt_cursor* cursor, void* key) {
+	if(self->map)
+		return page_cursor_seek(self, cursor, key);
 
-	/* Case: the tree already exists.
-	 * (Rest of function body.)
-	 */
+	cursor->tree = self;
+	if(key == NULL) {
+		cursor->leaf = first_leaf(self);
+		cursor->index = 0;
+		return cursor->leaf != NULL;
+	}
 
-	node* leaf = find_leaf(root, key);
+	cursor->leaf = find_leaf(self, key);
+	if(cursor->leaf == NULL)
+		return false;
 
-	/* Case: leaf has room for key and pointer.
-	*/
+	cursor->index = node_rank_lt(self, cursor->leaf, key);
+	if(cursor->index == cursor->leaf->num_keys) {
+		// every key of this leaf is smaller, the successor starts the next leaf
+		cursor->leaf = next_leaf(self, cursor->leaf);
+		cursor->index = 0;
+	}
+	return cursor->leaf != NULL;
+}
 
-	if(leaf->num_keys < order - 1) {
-		leaf = insert_into_leaf(leaf, key, pointer);
-		return root;
+bool bpt_cursor_seek_last(struct bpt* self, struct bpt_cursor* cursor, void* key) {
+	if(self->map)
+		return page_cursor_seek_last(self, cursor, key);
+
+	cursor->tree = self;
+	if(key == NULL) {
+		cursor->leaf = last_leaf(self);
+		cursor->index = cursor->leaf ? cursor->leaf->num_keys - 1 : 0;
+		return cursor->leaf != NULL;
 	}
 
-	/* Case:  leaf must be split.
-	*/
+	cursor->leaf = find_leaf(self, key);
+	if(cursor->leaf == NULL)
+		return false;
 
-	return insert_into_leaf_after_splitting(root, leaf, key, pointer);
+	cursor->index = node_rank_le(self, cursor->leaf, key) - 1;
+	if(cursor->index < 0) {
+		// every key of this leaf is greater, the predecessor ends the previous leaf
+		cursor->leaf = prev_leaf(self, cursor->leaf);
+		cursor->index = cursor->leaf ? cursor->leaf->num_keys - 1 : 0;
+	}
+	return cursor->leaf != NULL;
 }
 
-// DELETION.
+bool bpt_cursor_next(struct bpt_cursor* self) {
+	if(self->tree->map)
+		return page_cursor_next(self);
 
-/* Utility function for deletion.  Retrieves
- * the index of a node's nearest neighbor (sibling)
- * to the left if one exists.  If not (the node
- * is the leftmost child), returns -1 to signify
- * this special case.
- */
-int get_neighbor_index(node* n) {
-	int i;
+	if(self->leaf == NULL)
+		return false;
 
-	/* Return the index of the key to the left
-	 * of the pointer in the parent pointing
-	 * to n.
-	 * If n is the leftmost child, this means
-	 * return -1.
-	 */
-	for(i = 0; i <= n->parent->num_keys; i++)
-		if(n->parent->pointers[i] == n) return i - 1;
+	if(++self->index == self->leaf->num_keys) {
+		self->leaf = next_leaf(self->tree, self->leaf);
+		self->index = 0;
+	}
+	return self->leaf != NULL;
+}
+
+bool bpt_cursor_prev(struct bpt_cursor* self) {
+	if(self->tree->map)
+		return page_cursor_prev(self);
 
-	// Error state.
-	printf("Search for nonexistent pointer to node in parent.\n");
-	printf("Node:  %#lx\n", (unsigned long)n);
-	exit(EXIT_FAILURE);
+	if(self->leaf == NULL)
+		return false;
+
+	if(--self->index < 0) {
+		self->leaf = prev_leaf(self->tree, self->leaf);
+		self->index = self->leaf ? self->leaf->num_keys - 1 : 0;
+	}
+	return self->leaf != NULL;
 }
 
-node* remove_entry_from_node(node* n, int key, node* pointer) {
-	int i, num_pointers;
+void* bpt_cursor_key(struct bpt_cursor* self) {
+	if(self->tree->map)
+		return page_cursor_key(self);
 
-	// Remove the key and shift other keys accordingly.
-	i = 0;
-	while(n->keys[i] != key) i++;
-	for(++i; i < n->num_keys; i++) n->keys[i - 1] = n->keys[i];
+	return self->leaf ? key_at(self->tree, self->leaf, self->index) : NULL;
+}
 
-	// Remove the pointer and shift other pointers accordingly.
-	// First determine number of pointers.
-	num_pointers = n->is_leaf ? n->num_keys : n->num_keys + 1;
-	i = 0;
-	while(n->pointers[i] != pointer) i++;
-	for(++i; i < num_pointers; i++) n->pointers[i - 1] = n->pointers[i];
+void* bpt_cursor_value(struct bpt_cursor* self) {
+	if(self->tree->map)
+		return page_cursor_value(self);
 
-	// One key fewer.
-	n->num_keys--;
-
-	// Set the other pointers to NULL for tidiness.
-	// A leaf uses the last pointer to point to the next leaf.
-	if(n->is_leaf)
-		for(i = n->num_keys; i < order - 1; i++) n->pointers[i] = NULL;
-	else
-		for(i = n->num_keys + 1; i < order; i++) n->pointers[i] = NULL;
+	if(self->leaf == NULL)
+		return NULL;
 
-	return n;
+	void* pointer = self->leaf->pointers[self->index];
+	return self->tree->flags & BPT_RECORDS ? ((record*)pointer)->value : pointer;
 }
 
-node* adjust_root(node* root) {
-	node* new_root;
-
-	/* Case: nonempty root.
-	 * Key and pointer have already been deleted,
-	 * so nothing to be done.
-	 */
-
-	if(root->num_keys > 0) return root;
-
-	/* Case: empty root.
-	*/
-
-	// If it has a child, promote
-	// the first (only) child
-	// as the new root.
+bool bpt_load_sorted(struct bpt* self, void* keys, void** values, size_t count, double fill_factor) {
+	if(self->map || self->frozen || self->root != NULL || !(fill_factor > 0 && fill_factor <= 1))
+		return false;
 
-	if(!root->is_leaf) {
-		new_root = root->pointers[0];
-		new_root->parent = NULL;
-	}
+	char* packed_keys = (char*)keys;
+	for(size_t i = 1; i < count; ++i)
+		if(key_compare(self, packed_keys + (i - 1) * self->key_size, packed_keys + i * self->key_size) >= 0)
+			return false;
 
-	// If it is a leaf (has no children),
-	// then the whole tree is empty.
+	if(!count)
+		return true;
 
-	else
-		new_root = NULL;
+	unshare(self);
+	if(!bulk_load(self, packed_keys, values, count, fill_factor))
+		return false;
 
-	free(root->keys);
-	free(root->pointers);
-	free(root);
+	self->size = count;
+	if(self->log)
+		for(size_t i = 0; i < count; i++)
+			log_append(self, BPT_LOG_PUT, packed_keys + i * self->key_size, NULL, values[i]);
+	return true;
+}
 
-	return new_root;
+bool bpt_save(struct bpt* self, const char* path) {
+	return save_file(self, path, false);
 }
 
-/* Coalesces a node that has become
- * too small after deletion
- * with a neighboring node that
- * can accept the additional entries
- * without exceeding the maximum.
- */
-node* coalesce_nodes(node* root, node* n, node* neighbor, int neighbor_index,
-		int k_prime) {
-	int i, j, neighbor_insertion_index, n_end;
-	node* tmp;
+struct bpt* bpt_open(const char* path, bpt_compare compare) {
+	struct bpt_file_header header;
+	struct stat st;
+	struct bpt* self = NULL;
+	void* map;
 
-	/* Swap neighbor with node if node is on the
-	 * extreme left and neighbor is to its right.
-	 */
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return NULL;
 
-	if(neighbor_index == -1) {
-		tmp = n;
-		n = neighbor;
-		neighbor = tmp;
+	if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(header)) {
+		close(fd);
+		return NULL;
 	}
 
-	/* Starting point in the neighbor for copying
-	 * keys and pointers from n.
-	 * Recall that n and neighbor have swapped places
-	 * in the special case of n being a leftmost child.
-	 */
+	// the mapping keeps the file referenced after the descriptor is gone
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return NULL;
 
-	neighbor_insertion_index = neighbor->num_keys;
+	memcpy(&header, map, sizeof(header));
+	if(memcmp(header.magic, BPT_FILE_MAGIC, sizeof(header.magic)) == 0 && header.version == BPT_FILE_VERSION)
+		self = bpt_create_keyed(header.order, 0, header.key_type, header.key_size, compare);
 
-	/* Case:  nonleaf node.
-	 * Append k_prime and the following pointer.
-	 * Append all pointers and keys from the neighbor.
-	 */
+	if(self == NULL || self->key_size != header.key_size || page_block_size(self) != header.page_size
+			|| header.num_pages > (uint64_t)st.st_size / header.page_size
+			|| header.root >= header.num_pages) {
+		free(self);
+		munmap(map, st.st_size);
+		return NULL;
+	}
 
-	if(!n->is_leaf) {
-		/* Append k_prime.
-		*/
+	// lookups touch pages all over the file, readahead would only waste memory
+	madvise(map, st.st_size, MADV_RANDOM);
 
-		neighbor->keys[neighbor_insertion_index] = k_prime;
-		neighbor->num_keys++;
+	self->map = map;
+	self->map_size = st.st_size;
+	self->page_size = header.page_size;
+	self->root_page = header.root;
+	self->size = header.size;
+	return self;
+}
 
-		n_end = n->num_keys;
+struct bpt* bpt_open_logged(const char* path, int order, enum bpt_key_type key_type,
+		size_t key_size, bpt_compare compare, size_t group_size) {
+	struct bpt* self = bpt_create_keyed(order, 0, key_type, key_size, compare);
+	if(self == NULL)
+		return NULL;
 
-		for(i = neighbor_insertion_index + 1, j = 0; j < n_end; i++, j++) {
-			neighbor->keys[i] = n->keys[j];
-			neighbor->pointers[i] = n->pointers[j];
-			neighbor->num_keys++;
-			n->num_keys--;
+	struct bpt* mapped = bpt_open(path, compare);
+	if(mapped == NULL && access(path, F_OK) == 0) {
+		bpt_destroy(self);
+		return NULL;
+	}
+
+	if(mapped != NULL) {
+		// the page file is loaded into memory, where the log is replayed and changes go
+		struct bpt_cursor cursor;
+		size_t count = 0;
+		char* keys = malloc(mapped->size * self->key_size + 1);
+		void** values = malloc(mapped->size * sizeof(void*) + 1);
+		bool loaded = keys != NULL && values != NULL
+			&& mapped->key_type == self->key_type && mapped->key_size == self->key_size;
+		for(bool found = loaded && bpt_cursor_seek(mapped, &cursor, NULL); found;
+				found = bpt_cursor_next(&cursor), count++) {
+			memcpy(keys + count * self->key_size, bpt_cursor_key(&cursor), self->key_size);
+			values[count] = bpt_cursor_value(&cursor);
+		}
+		loaded = loaded && bpt_load_sorted(self, keys, values, count, BPT_LOG_FILL_FACTOR);
+		free(keys);
+		free(values);
+		bpt_destroy(mapped);
+		if(!loaded) {
+			bpt_destroy(self);
+			return NULL;
 		}
+	}
 
-		/* The number of pointers is always
-		 * one more than the number of keys.
-		 */
+	if(!log_open(self, path, group_size)) {
+		bpt_destroy(self);
+		return NULL;
+	}
+	return self;
+}
 
-		neighbor->pointers[i] = n->pointers[j];
+bool bpt_commit(struct bpt* self) {
+	struct bpt_log* log = self->log;
+	if(log == NULL || log->lost)
+		return false;
+	if(log->pending == 0)
+		return true;
+
+	// whatever a failed attempt left past the last commit is cut off first,
+	// the retry must not append whole records after a torn one
+	if(log->torn && ftruncate(log->fd, log->end) != 0)
+		return false;
+	log->torn = false;
+
+	// an interrupted write is retried, one that makes no progress is an error
+	bool done = true;
+	for(size_t written = 0; done && written < log->used;) {
+		ssize_t n = write(log->fd, log->buffer + written, log->used - written);
+		if(n < 0 && errno == EINTR)
+			continue;
+		done = n > 0;
+		written += done ? n : 0;
+	}
+	if(!done || fdatasync(log->fd) != 0) {
+		log->torn = ftruncate(log->fd, log->end) != 0;
+		return false;
+	}
 
-		/* All children must now point up to the same parent.
-		*/
+	log->end += log->used;
+	log->used = 0;
+	log->pending = 0;
+	return true;
+}
 
-		for(i = 0; i < neighbor->num_keys + 1; i++) {
-			tmp = (node*)neighbor->pointers[i];
-			tmp->parent = neighbor;
-		}
-	}
+bool bpt_checkpoint(struct bpt* self) {
+	if(!bpt_commit(self))
+		return false;
+
+	struct bpt_log* log = self->log;
+	size_t length = strlen(log->path);
+	char* temp_path = malloc(length + sizeof(".tmp"));
+	if(temp_path == NULL)
+		return false;
+	memcpy(temp_path, log->path, length);
+	memcpy(temp_path + length, ".tmp", sizeof(".tmp"));
+
+	// the new page file replaces the old one whole, or not at all
+	bool done = save_file(self, temp_path, true) && rename(temp_path, log->path) == 0;
+	if(!done)
+		unlink(temp_path);
+	free(temp_path);
+	if(!done)
+		return false;
+
+	// only now is the log redundant: replaying it over the new pages changes nothing
+	if(!sync_directory(log->path) || ftruncate(log->fd, sizeof(struct bpt_log_header)) != 0)
+		return false;
+	log->end = sizeof(struct bpt_log_header);
+	return fdatasync(log->fd) == 0;
+}
 
-	/* In a leaf, append the keys and pointers of
-	 * n to the neighbor.
-	 * Set the neighbor's last pointer to point to
-	 * what had been n's right neighbor.
-	 */
+static node* find_leaf(struct bpt* self, void* key) {
+	if(self->root == NULL)
+		return NULL;
 
-	else {
-		for(i = neighbor_insertion_index, j = 0; j < n->num_keys; i++, j++) {
-			neighbor->keys[i] = n->keys[j];
-			neighbor->pointers[i] = n->pointers[j];
-			neighbor->num_keys++;
-		}
-		neighbor->pointers[order - 1] = n->pointers[order - 1];
-	}
+	node* c = self->root;
+	while(!c->is_leaf)
+		c = (node*)c->pointers[node_rank_le(self, c, key)];
 
-	root = delete_entry(root, n->parent, k_prime, n);
-	free(n->keys);
-	free(n->pointers);
-	free(n);
-	return root;
+	return c;
 }
 
-/* Redistributes entries between two nodes when
- * one has become too small after deletion
- * but its neighbor is too big to append the
- * small node's entries without exceeding the
- * maximum
+/* Prefetches the header and keys of a node, everything a search reads
+ * before it knows which pointer to follow.
  */
-node* redistribute_nodes(node* root, node* n, node* neighbor,
-		int neighbor_index, int k_prime_index, int k_prime) {
-	int i;
-	node* tmp;
+static inline void prefetch_node(struct bpt* self, node* n) {
+	size_t size = node_pointers_offset(self);
+	for(size_t offset = 0; offset < size; offset += BPT_NODE_ALIGN)
+		__builtin_prefetch((char*)n + offset);
+}
 
-	/* Case: n has a neighbor to the left.
-	 * Pull the neighbor's last key-pointer pair over
-	 * from the neighbor's right end to n's left end.
-	 */
+/* Descends up to BPT_BATCH_GROUP keys level by level in lockstep.
+ * Every leaf sits at the same depth, so one level of all keys is
+ * searched while the nodes they step into for the next level are
+ * being prefetched, overlapping the cache misses of the whole group
+ * instead of stalling on each one in turn.  A key that lands in the
+ * same node as the previous one and is still below the separator the
+ * previous key stopped at reuses its child index, so sorted batches
+ * search shared descent prefixes once.
+ */
+static void find_leaf_batch(struct bpt* self, char* keys, size_t count, node** leaves) {
+	int index[BPT_BATCH_GROUP];
+	size_t key_size = self->key_size;
 
-	if(neighbor_index != -1) {
-		if(!n->is_leaf) n->pointers[n->num_keys + 1] = n->pointers[n->num_keys];
-		for(i = n->num_keys; i > 0; i--) {
-			n->keys[i] = n->keys[i - 1];
-			n->pointers[i] = n->pointers[i - 1];
+	for(size_t j = 0; j < count; j++)
+		leaves[j] = self->root;
+	if(self->root == NULL)
+		return;
+
+	while(!leaves[0]->is_leaf) {
+		for(size_t j = 0; j < count; j++) {
+			node* c = leaves[j];
+			char* key = keys + j * key_size;
+			if(j > 0 && c == leaves[j - 1]
+					&& key_compare(self, key, key - key_size) >= 0
+					&& (index[j - 1] == c->num_keys
+						|| key_compare(self, key, key_at(self, c, index[j - 1])) < 0))
+				index[j] = index[j - 1];
+			else
+				index[j] = node_rank_le(self, c, key);
 		}
-		if(!n->is_leaf) {
-			n->pointers[0] = neighbor->pointers[neighbor->num_keys];
-			tmp = (node*)n->pointers[0];
-			tmp->parent = n;
-			neighbor->pointers[neighbor->num_keys] = NULL;
-			n->keys[0] = k_prime;
-			n->parent->keys[k_prime_index] = neighbor->keys[neighbor->num_keys - 1];
-		} else {
-			n->pointers[0] = neighbor->pointers[neighbor->num_keys - 1];
-			neighbor->pointers[neighbor->num_keys - 1] = NULL;
-			n->keys[0] = neighbor->keys[neighbor->num_keys - 1];
-			n->parent->keys[k_prime_index] = n->keys[0];
+		for(size_t j = 0; j < count; j++) {
+			leaves[j] = (node*)leaves[j]->pointers[index[j]];
+			if(j == 0 || leaves[j] != leaves[j - 1])
+				prefetch_node(self, leaves[j]);
 		}
 	}
+}
 
-	/* Case: n is the leftmost child.
-	 * Take a key-pointer pair from the neighbor to the right.
-	 * Move the neighbor's leftmost key-pointer pair
-	 * to n's rightmost position.
-	 */
+/* Descends towards key like find_leaf(), recording the path. */
+static node* find_path(struct bpt* self, void* key, struct path* path) {
+	node* c = self->root;
+	if(c == NULL)
+		return NULL;
 
-	else {
-		if(n->is_leaf) {
-			n->keys[n->num_keys] = neighbor->keys[0];
-			n->pointers[n->num_keys] = neighbor->pointers[0];
-			n->parent->keys[k_prime_index] = neighbor->keys[1];
-		} else {
-			n->keys[n->num_keys] = k_prime;
-			n->pointers[n->num_keys + 1] = neighbor->pointers[0];
-			tmp = (node*)n->pointers[n->num_keys + 1];
-			tmp->parent = n;
-			n->parent->keys[k_prime_index] = neighbor->keys[0];
-		}
-		for(i = 0; i < neighbor->num_keys - 1; i++) {
-			neighbor->keys[i] = neighbor->keys[i + 1];
-			neighbor->pointers[i] = neighbor->pointers[i + 1];
-		}
-		if(!n->is_leaf) neighbor->pointers[i] = neighbor->pointers[i + 1];
+	path->depth = 0;
+	path->nodes[0] = c;
+	while(!c->is_leaf) {
+		int i = node_rank_le(self, c, key);
+		path->slots[path->depth] = i;
+		c = (node*)c->pointers[i];
+		path->nodes[++path->depth] = c;
 	}
+	return c;
+}
 
-	/* n now has one more key and one more pointer;
-	 * the neighbor has one fewer of each.
-	 */
+static node* first_leaf(struct bpt* self) {
+	node* c = self->root;
+	if(c == NULL)
+		return NULL;
 
-	n->num_keys++;
-	neighbor->num_keys--;
+	while(!c->is_leaf)
+		c = (node*)c->pointers[0];
+	return c;
+}
+
+static node* last_leaf(struct bpt* self) {
+	node* c = self->root;
+	if(c == NULL)
+		return NULL;
 
-	return root;
+	while(!c->is_leaf)
+		c = (node*)c->pointers[c->num_keys];
+	return c;
 }
 
-/* Deletes an entry from the B+ tree.
- * Removes the record and its key and pointer
- * from the leaf, and then makes all appropriate
- * changes to preserve the B+ tree properties.
+/* The leaf after a given one, through the leaf chain
+ * unless nodes may be shared with snapshots.  Then the
+ * chain is stale and the successor is reached like the
+ * predecessor in prev_leaf(): below the deepest node
+ * where the path towards the leaf did not take the
+ * rightmost child, the leftmost leaf under the child
+ * just right of that turn.
  */
-node* delete_entry(node* root, node* n, int key, void* pointer) {
-	int min_keys;
-	node* neighbor;
-	int neighbor_index;
-	int k_prime_index, k_prime;
-	int capacity;
+static node* next_leaf(struct bpt* self, node* leaf) {
+	if(!self->shared)
+		return leaf->pointers[self->order - 1];
 
-	// Remove key and pointer from node.
+	node* c = self->root;
+	node* turn = NULL;
+	int turn_index = 0;
+	void* key = key_at(self, leaf, leaf->num_keys - 1);
 
-	n = remove_entry_from_node(n, key, pointer);
+	while(!c->is_leaf) {
+		int i = node_rank_le(self, c, key);
+		if(i < c->num_keys)
+			turn = c, turn_index = i;
+		c = (node*)c->pointers[i];
+	}
+	if(turn == NULL)
+		return NULL;
 
-	/* Case:  deletion from the root.
-	*/
+	c = (node*)turn->pointers[turn_index + 1];
+	while(!c->is_leaf)
+		c = (node*)c->pointers[0];
+	return c;
+}
 
-	if(n == root) return adjust_root(root);
+/* Leaves only link forward, so the leaf before
+ * a given one is reached by descending towards it
+ * and remembering the deepest node where the path
+ * did not take the leftmost child: the rightmost
+ * leaf under the child just left of that turn is
+ * the predecessor.
+ */
+static node* prev_leaf(struct bpt* self, node* leaf) {
+	node* c = self->root;
+	node* turn = NULL;
+	int turn_index = 0;
+	void* key = key_at(self, leaf, 0);
 
-	/* Case:  deletion from a node below the root.
-	 * (Rest of function body.)
-	 */
+	while(!c->is_leaf) {
+		int i = node_rank_le(self, c, key);
+		if(i > 0)
+			turn = c, turn_index = i;
+		c = (node*)c->pointers[i];
+	}
+	if(turn == NULL)
+		return NULL;
 
-	/* Determine minimum allowable size of node,
-	 * to be preserved after deletion.
-	 */
+	c = (node*)turn->pointers[turn_index - 1];
+	while(!c->is_leaf)
+		c = (node*)c->pointers[c->num_keys];
+	return c;
+}
 
-	min_keys = n->is_leaf ? cut(order - 1) : cut(order) - 1;
+/* Finds and returns the leaf slot holding the value, or the record
+ * in BPT_RECORDS mode, to which a key refers.
+ */
+static void** find(struct bpt* self, void* key) {
+	node* leaf = find_leaf(self, key);
+	if(leaf == NULL)
+		return NULL;
 
-	/* Case:  node stays at or above minimum.
-	 * (The simple case.)
-	 */
+	int i = node_rank_lt(self, leaf, key);
+	if(i == leaf->num_keys || key_compare(self, key_at(self, leaf, i), key) != 0)
+		return NULL;
+	return &leaf->pointers[i];
+}
 
-	if(n->num_keys >= min_keys) return root;
+/* Finds the appropriate place to split a node that is too big into two. */
+static int cut(int length) {
+	/* return length % 2 == 0 ? length / 2 : length / 2 + 1; */
+	return (length / 2) + (length % 2);
+}
 
-	/* Case:  node falls below minimum.
-	 * Either coalescence or redistribution
-	 * is needed.
-	 */
+// INSERTION
 
-	/* Find the appropriate neighbor node with which
-	 * to coalesce.
-	 * Also find the key (k_prime) in the parent
-	 * between the pointer to node n and the pointer
-	 * to the neighbor.
-	 */
+/* Byte offsets of the key and pointer arrays inside a node block. The header,
+ * keys and pointers share one allocation so a descent touches a single
+ * contiguous run of cache lines per level.  With binary keys the block holds
+ * the key heads and, where the keys would be, the prefix of the node.
+ */
+static size_t node_keys_offset(struct bpt* self) {
+	size_t heads_size = 0;
+	if(self->key_type == BPT_KEY_BINARY) {
+		heads_size = (self->order - 1) * sizeof(uint64_t);
+		heads_size = (heads_size + BPT_SEARCH_WIDTH - 1) / BPT_SEARCH_WIDTH * BPT_SEARCH_WIDTH;
+	}
+	return sizeof(node) + heads_size;
+}
 
-	neighbor_index = get_neighbor_index(n);
-	k_prime_index = neighbor_index == -1 ? 0 : neighbor_index;
-	k_prime = n->parent->keys[k_prime_index];
-	neighbor = neighbor_index == -1 ? n->parent->pointers[1]
-		: n->parent->pointers[neighbor_index];
+static size_t node_pointers_offset(struct bpt* self) {
+	size_t keys_size = (self->key_type == BPT_KEY_BINARY ? 1 : self->order - 1) * self->key_size;
+	keys_size = (keys_size + BPT_SEARCH_WIDTH - 1) / BPT_SEARCH_WIDTH * BPT_SEARCH_WIDTH;
+	size_t offset = node_keys_offset(self) + keys_size;
+	return (offset + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+}
 
-	capacity = n->is_leaf ? order : order - 1;
+static size_t node_block_size(struct bpt* self) {
+	size_t size = node_pointers_offset(self) + self->order * sizeof(void*);
+	return (size + BPT_NODE_ALIGN - 1) & ~(size_t)(BPT_NODE_ALIGN - 1);
+}
 
-	/* Coalescence.*/
+/* Creates a new general node, which can be adapted to serve as either a leaf or an internal node. */
+static node* make_node(struct bpt* self, bool is_leaf) {
+	node* new_node = aligned_alloc(BPT_NODE_ALIGN, self->node_size);
+	if(new_node == NULL)
+		return NULL;
 
-	if(neighbor->num_keys + n->num_keys < capacity)
-		return coalesce_nodes(root, n, neighbor, neighbor_index, k_prime);
-	/* Redistribution.*/
-	else
-		return redistribute_nodes(root, n, neighbor, neighbor_index, k_prime_index,
-				k_prime);
+	memset(new_node, 0, self->node_size);
+	new_node->keys = (char*)new_node + node_keys_offset(self);
+	if(self->key_type == BPT_KEY_BINARY) {
+		// binary keys are read on head ties only, outside the block a descent reads
+		new_node->keys = malloc((self->order - 1) * self->key_size);
+		if(new_node->keys == NULL) {
+			free(new_node);
+			return NULL;
+		}
+	}
+	new_node->pointers = (void**)((char*)new_node + node_pointers_offset(self));
+	new_node->is_leaf = is_leaf;
+	new_node->refs = 1;
+	return new_node;
 }
 
-node* delete(node* root, int key) {
-	node* key_leaf;
-	record* key_record;
+static void free_node(struct bpt* self, node* n) {
+	if(self->key_type == BPT_KEY_BINARY)
+		free(n->keys);
+	free(n);
+}
+
+// COPY ON WRITE.
 
-	key_record = find(root, key, false);
-	key_leaf = find_leaf(root, key);
-	if(key_record != NULL && key_leaf != NULL) {
-		root = delete_entry(root, key_leaf, key, key_record);
-		free(key_record);
+/* Snapshots share nodes with the tree they were taken from.  Every node
+ * counts the trees and parent nodes referring to it and one referred to
+ * more than once is immutable: mutations of a snapshotted tree copy such
+ * nodes on their way down, so the nodes a mutation writes to are always
+ * referred to by its tree only.  Counts are updated atomically because
+ * snapshots may be destroyed by other threads.
+ */
+static node* copy_node(struct bpt* self, node* n) {
+	node* copy = aligned_alloc(BPT_NODE_ALIGN, self->node_size);
+	if(copy == NULL) {
+		perror("Node copy.");
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(copy, n, self->node_size);
+	copy->keys = (char*)copy + node_keys_offset(self);
+	if(self->key_type == BPT_KEY_BINARY) {
+		copy->keys = malloc((self->order - 1) * self->key_size);
+		if(copy->keys == NULL) {
+			perror("Node copy.");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(copy->keys, n->keys, (size_t)n->num_keys * self->key_size);
 	}
-	return root;
+	copy->pointers = (void**)((char*)copy + ((char*)n->pointers - (char*)n));
+	copy->refs = 1;
+	if(!copy->is_leaf)
+		for(int i = 0; i <= copy->num_keys; i++)
+			__atomic_add_fetch(&((node*)copy->pointers[i])->refs, 1, __ATOMIC_RELAXED);
+	return copy;
 }
 
-void destroy_tree(node* node) {
-	if(node == NULL)
+/* Once every snapshot sharing nodes with a tree is destroyed, its nodes
+ * are all private again: the leaf chain, left stale by the copies, is
+ * relinked once and the tree goes back to following it.  Snapshots keep
+ * descending, another thread may be reading them.
+ */
+static void unshare(struct bpt* self) {
+	if(!self->shared || self->frozen || __atomic_load_n(self->sharers, __ATOMIC_ACQUIRE) > 1)
 		return;
 
-	if(node->is_leaf) {
-		for(int i = 0; i < node->num_keys; i++)
-			free(node->pointers[i]); // delete records
-	} else {
-		for(int i = 0; i < node->num_keys + 1; i++)
-			destroy_tree(node->pointers[i]); // cascade intermediate nodes
+	for(node* leaf = first_leaf(self); leaf != NULL;) {
+		node* next = next_leaf(self, leaf);
+		leaf->pointers[self->order - 1] = next;
+		leaf = next;
 	}
-	free(node->pointers);
-	free(node->keys);
-	free(node);
+	release_sharers(self);
+	self->shared = false;
 }
 
-#include <time.h>
-int main(int argc, char** argv) {
-	node* root = NULL;
+/* Drops the tree from the count of trees sharing its nodes, freed by the last one. */
+static void release_sharers(struct bpt* self) {
+	if(self->sharers != NULL && __atomic_sub_fetch(self->sharers, 1, __ATOMIC_ACQ_REL) == 0)
+		free(self->sharers);
+	self->sharers = NULL;
+}
 
-	// throughput test
-	clock_t b, e;
-	b = clock();
-	for(int i = 0; i < 1000000; ++i)
-		root = insert(root, i, (void*)(intptr_t)4567);
-	e = clock();
-	printf("[INSERT] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+/* Replaces the shared nodes of a path by private copies, top-down so
+ * that each copy is linked into a parent that is already private.
+ */
+static void own_path(struct bpt* self, struct path* path) {
+	if(!self->shared)
+		return;
 
-	b = clock();
-	for(int i = 0; i < 1000000; ++i)
-		root = delete(root, i);
-	e = clock();
-	printf("[DELETE] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	for(int level = 0; level <= path->depth; level++) {
+		node* n = path->nodes[level];
+		if(__atomic_load_n(&n->refs, __ATOMIC_ACQUIRE) == 1)
+			continue;
+
+		node* copy = copy_node(self, n);
+		if(level == 0)
+			self->root = copy;
+		else
+			path->nodes[level - 1]->pointers[path->slots[level - 1]] = copy;
+		path->nodes[level] = copy;
+		destroy_tree(self, n);
+	}
+}
 
-	destroy_tree(root);
-	return EXIT_SUCCESS;
+/* Returns the child at index of a private node, copied first if shared. */
+static node* own_child(struct bpt* self, node* parent, int index) {
+	node* n = parent->pointers[index];
+	if(!self->shared || __atomic_load_n(&n->refs, __ATOMIC_ACQUIRE) == 1)
+		return n;
+
+	node* copy = copy_node(self, n);
+	parent->pointers[index] = copy;
+	destroy_tree(self, n);
+	return copy;
+}
+
+/* Inserts a new value, or pointer to a record, and its
+ * corresponding key into a leaf at the given position.
+ */
+static void insert_into_leaf(struct bpt* self, node* leaf, int insertion_point, void* key,
+		void* pointer) {
+	int i;
+
+	key_move(self, leaf, insertion_point + 1, insertion_point, leaf->num_keys - insertion_point);
+	for(i = leaf->num_keys; i > insertion_point; i--)
+		leaf->pointers[i] = leaf->pointers[i - 1];
+	key_copy(self, key_at(self, leaf, insertion_point), key);
+	leaf->pointers[insertion_point] = pointer;
+	leaf->num_keys++;
+	node_insert_head(self, leaf, insertion_point);
+}
+
+/* Inserts a new key and value
+ * into a leaf so as to exceed
+ * the tree's order, causing the leaf to be split
+ * in half.
+ */
+static bool insert_into_leaf_after_splitting(struct bpt* self, struct path* path,
+		int insertion_index, void* key, void* pointer) {
+	int order = self->order;
+	size_t key_size = self->key_size;
+	node* leaf = path->nodes[path->depth];
+	node* new_leaf;
+	char* temp_keys;
+	void** temp_pointers;
+	int split, i, j;
+
+	new_leaf = make_node(self, true);
+	if(new_leaf == NULL)
+		return false;
+
+	temp_keys = malloc(order * key_size);
+	if(temp_keys == NULL) {
+		perror("Temporary keys array.");
+		exit(EXIT_FAILURE);
+	}
+
+	temp_pointers = malloc(order * sizeof(void*));
+	if(temp_pointers == NULL) {
+		perror("Temporary pointers array.");
+		exit(EXIT_FAILURE);
+	}
+
+	for(i = 0, j = 0; i < leaf->num_keys; i++, j++) {
+		if(j == insertion_index) j++;
+		temp_pointers[j] = leaf->pointers[i];
+	}
+	memcpy(temp_keys, leaf->keys, insertion_index * key_size);
+	memcpy(temp_keys + (insertion_index + 1) * key_size, key_at(self, leaf, insertion_index),
+			(leaf->num_keys - insertion_index) * key_size);
+
+	key_copy(self, temp_keys + insertion_index * key_size, key);
+	temp_pointers[insertion_index] = pointer;
+
+	split = cut(order - 1);
+
+	memcpy(leaf->keys, temp_keys, split * key_size);
+	for(i = 0; i < split; i++)
+		leaf->pointers[i] = temp_pointers[i];
+	leaf->num_keys = split;
+
+	memcpy(new_leaf->keys, temp_keys + split * key_size, (order - split) * key_size);
+	for(i = split, j = 0; i < order; i++, j++)
+		new_leaf->pointers[j] = temp_pointers[i];
+	new_leaf->num_keys = order - split;
+	node_update_heads(self, leaf);
+	node_update_heads(self, new_leaf);
+
+	free(temp_pointers);
+	free(temp_keys);
+
+	new_leaf->pointers[order - 1] = leaf->pointers[order - 1];
+	leaf->pointers[order - 1] = new_leaf;
+
+	for(i = leaf->num_keys; i < order - 1; i++) leaf->pointers[i] = NULL;
+	for(i = new_leaf->num_keys; i < order - 1; i++) new_leaf->pointers[i] = NULL;
+
+	insert_into_parent(self, path, path->depth, key_at(self, new_leaf, 0), new_leaf);
+	return true;
+}
+
+/* Inserts a new key and pointer to a node
+ * into a node into which these can fit
+ * without violating the B+ tree properties.
+ */
+static void insert_into_node(struct bpt* self, node* n, int left_index, void* key,
+		node* right) {
+	int i;
+
+	for(i = n->num_keys; i > left_index; i--)
+		n->pointers[i + 1] = n->pointers[i];
+	key_move(self, n, left_index + 1, left_index, n->num_keys - left_index);
+	n->pointers[left_index + 1] = right;
+	key_copy(self, key_at(self, n, left_index), key);
+	n->num_keys++;
+	node_insert_head(self, n, left_index);
+}
+
+/* Inserts a new key and pointer to a node
+ * into a node, causing the node's size to exceed
+ * the order, and causing the node to split into two.
+ */
+static void insert_into_node_after_splitting(struct bpt* self, struct path* path, int level,
+		int left_index, void* key, node* right) {
+	int order = self->order;
+	size_t key_size = self->key_size;
+	node* old_node = path->nodes[level];
+	int i, j, split;
+	node* new_node;
+	char* temp_keys;
+	char* k_prime;
+	node** temp_pointers;
+
+	/* First create a temporary set of keys and pointers
+	 * to hold everything in order, including
+	 * the new key and pointer, inserted in their
+	 * correct places.
+	 * Then create a new node and copy half of the
+	 * keys and pointers to the old node and
+	 * the other half to the new.
+	 */
+
+	new_node = make_node(self, false);
+	if(new_node == NULL) {
+		perror("New node for splitting nodes.");
+		exit(EXIT_FAILURE);
+	}
+
+	temp_pointers = malloc((order + 1) * sizeof(node*));
+	if(temp_pointers == NULL) {
+		perror("Temporary pointers array for splitting nodes.");
+		exit(EXIT_FAILURE);
+	}
+	temp_keys = malloc(order * key_size);
+	if(temp_keys == NULL) {
+		perror("Temporary keys array for splitting nodes.");
+		exit(EXIT_FAILURE);
+	}
+
+	for(i = 0, j = 0; i < old_node->num_keys + 1; i++, j++) {
+		if(j == left_index + 1) j++;
+		temp_pointers[j] = old_node->pointers[i];
+	}
+
+	memcpy(temp_keys, old_node->keys, left_index * key_size);
+	memcpy(temp_keys + (left_index + 1) * key_size, key_at(self, old_node, left_index),
+			(old_node->num_keys - left_index) * key_size);
+
+	temp_pointers[left_index + 1] = right;
+	key_copy(self, temp_keys + left_index * key_size, key);
+
+	/* Copy half the keys and pointers to the
+	 * old and half to the new.
+	 */
+	split = cut(order);
+	memcpy(old_node->keys, temp_keys, (split - 1) * key_size);
+	for(i = 0; i < split; i++)
+		old_node->pointers[i] = temp_pointers[i];
+	old_node->num_keys = split - 1;
+	k_prime = temp_keys + (split - 1) * key_size;
+	memcpy(new_node->keys, temp_keys + split * key_size, (order - split) * key_size);
+	for(i = split, j = 0; i <= order; i++, j++)
+		new_node->pointers[j] = temp_pointers[i];
+	new_node->num_keys = order - split;
+	node_update_heads(self, old_node);
+	node_update_heads(self, new_node);
+	free(temp_pointers);
+
+	/* Insert a new key into the parent of the two
+	 * nodes resulting from the split, with
+	 * the old node to the left and the new to the right.
+	 * k_prime lives in temp_keys, so they are released
+	 * only once the parent has copied it.
+	 */
+
+	insert_into_parent(self, path, level, k_prime, new_node);
+	free(temp_keys);
+}
+
+/* Inserts a new node (leaf or internal node) into the B+ tree,
+ * right of the node at the given level of the path.
+ */
+static void insert_into_parent(struct bpt* self, struct path* path, int level, void* key,
+		node* right) {
+	int left_index;
+	node* parent;
+
+	/* Case: new root.*/
+
+	if(level == 0) {
+		insert_into_new_root(self, path->nodes[0], key, right);
+		return;
+	}
+
+	parent = path->nodes[level - 1];
+
+	/* Case: leaf or node. (Remainder of
+	 * function body.)
+	 */
+
+	/* The parent's pointer to the left
+	 * node is the one the descent took.
+	 */
+
+	left_index = path->slots[level - 1];
+
+	/* Simple case: the new key fits into the node.
+	*/
+
+	if(parent->num_keys < self->order - 1) {
+		insert_into_node(self, parent, left_index, key, right);
+		return;
+	}
+
+	/* Harder case:  split a node in order
+	 * to preserve the B+ tree properties.
+	 */
+
+	insert_into_node_after_splitting(self, path, level - 1, left_index, key, right);
+}
+
+/* Creates a new root for two subtrees
+ * and inserts the appropriate key into
+ * the new root.
+ */
+static void insert_into_new_root(struct bpt* self, node* left, void* key, node* right) {
+	node* root = make_node(self, false);
+	if(root == NULL) {
+		perror("New root.");
+		exit(EXIT_FAILURE);
+	}
+
+	key_copy(self, key_at(self, root, 0), key);
+	root->pointers[0] = left;
+	root->pointers[1] = right;
+	root->num_keys++;
+	node_update_heads(self, root);
+	self->root = root;
+}
+
+/* First insertion:
+ * start a new tree.
+ */
+static bool start_new_tree(struct bpt* self, void* key, void* pointer) {
+	node* root = make_node(self, true);
+	if(root == NULL)
+		return false;
+
+	key_copy(self, key_at(self, root, 0), key);
+	root->pointers[0] = pointer;
+	root->pointers[self->order - 1] = NULL;
+	root->num_keys++;
+	node_update_heads(self, root);
+	self->root = root;
+	return true;
+}
+
+/* Master insertion function.
+ * Inserts a key and an associated value into
+ * the B+ tree, causing the tree to be adjusted
+ * however necessary to maintain the B+ tree
+ * properties.
+ * Returns false if the key already exists or
+ * memory runs out.
+ */
+static bool insert(struct bpt* self, void* key, void* value) {
+	struct path path;
+	node* leaf = find_path(self, key, &path);
+	int insertion_point = 0;
+	if(leaf != NULL) {
+		insertion_point = node_rank_lt(self, leaf, key);
+		if(insertion_point < leaf->num_keys
+				&& key_compare(self, key_at(self, leaf, insertion_point), key) == 0)
+			return false;
+		own_path(self, &path);
+		leaf = path.nodes[path.depth];
+	}
+
+	/* Values live inline in the leaf slots unless
+	 * the tree asked for a record per value.
+	 */
+	void* pointer = value;
+	if(self->flags & BPT_RECORDS) {
+		record* r = (record*)malloc(sizeof(record));
+		if(r == NULL)
+			return false;
+
+		r->value = value;
+		pointer = r;
+	}
+
+	bool inserted;
+	if(leaf == NULL)
+		inserted = start_new_tree(self, key, pointer);
+	else {
+		/* Case: the tree already exists.
+		 * (Rest of function body.)
+		 */
+
+		/* Case: leaf has room for key and pointer.
+		*/
+
+		if(leaf->num_keys < self->order - 1) {
+			insert_into_leaf(self, leaf, insertion_point, key, pointer);
+			return true;
+		}
+
+		/* Case:  leaf must be split.
+		*/
+
+		inserted = insert_into_leaf_after_splitting(self, &path, insertion_point, key, pointer);
+	}
+
+	if(!inserted && self->flags & BPT_RECORDS)
+		free(pointer);
+	return inserted;
+}
+
+// DELETION.
+
+/* Removes the entry at index from a node: the key and
+ * value at index in a leaf, the child at index and the
+ * key separating it from its left sibling in an
+ * internal node.
+ */
+static node* remove_entry_from_node(struct bpt* self, node* n, int index) {
+	int i, num_pointers, key_index;
+
+	i = index;
+	key_index = n->is_leaf ? index : index - 1;
+
+	// Remove the key and shift other keys accordingly.
+	key_move(self, n, key_index, key_index + 1, n->num_keys - key_index - 1);
+
+	// Remove the pointer and shift other pointers accordingly.
+	// First determine number of pointers.
+	num_pointers = n->is_leaf ? n->num_keys : n->num_keys + 1;
+	for(++i; i < num_pointers; i++) n->pointers[i - 1] = n->pointers[i];
+
+	// One key fewer.
+	n->num_keys--;
+
+	// Set the other pointers to NULL for tidiness.
+	// A leaf uses the last pointer to point to the next leaf.
+	if(n->is_leaf)
+		for(i = n->num_keys; i < self->order - 1; i++) n->pointers[i] = NULL;
+	else
+		for(i = n->num_keys + 1; i < self->order; i++) n->pointers[i] = NULL;
+
+	node_remove_head(self, n, key_index);
+	return n;
+}
+
+static void adjust_root(struct bpt* self) {
+	node* root = self->root;
+	node* new_root;
+
+	/* Case: nonempty root.
+	 * Key and pointer have already been deleted,
+	 * so nothing to be done.
+	 */
+
+	if(root->num_keys > 0) return;
+
+	/* Case: empty root.
+	*/
+
+	// If it has a child, promote
+	// the first (only) child
+	// as the new root.
+
+	if(!root->is_leaf)
+		new_root = root->pointers[0];
+
+	// If it is a leaf (has no children),
+	// then the whole tree is empty.
+
+	else
+		new_root = NULL;
+
+	free_node(self, root);
+	self->root = new_root;
+}
+
+/* Coalesces a node that has become
+ * too small after deletion
+ * with a neighboring node that
+ * can accept the additional entries
+ * without exceeding the maximum.
+ */
+static void coalesce_nodes(struct bpt* self, struct path* path, int level, node* neighbor,
+		int neighbor_index, void* k_prime) {
+	int i, j, neighbor_insertion_index;
+	node* n = path->nodes[level];
+	node* tmp;
+
+	/* Swap neighbor with node if node is on the
+	 * extreme left and neighbor is to its right.
+	 */
+
+	if(neighbor_index == -1) {
+		tmp = n;
+		n = neighbor;
+		neighbor = tmp;
+	}
+
+	/* Starting point in the neighbor for copying
+	 * keys and pointers from n.
+	 * Recall that n and neighbor have swapped places
+	 * in the special case of n being a leftmost child.
+	 */
+
+	neighbor_insertion_index = neighbor->num_keys;
+
+	/* Case:  nonleaf node.
+	 * Append k_prime and the following pointer.
+	 * Append all pointers and keys from the neighbor.
+	 */
+
+	if(!n->is_leaf) {
+		/* Append k_prime.
+		*/
+
+		key_copy(self, key_at(self, neighbor, neighbor_insertion_index), k_prime);
+		neighbor->num_keys++;
+
+		memcpy(key_at(self, neighbor, neighbor_insertion_index + 1), n->keys,
+				n->num_keys * self->key_size);
+		for(i = neighbor_insertion_index + 1, j = 0; j < n->num_keys; i++, j++)
+			neighbor->pointers[i] = n->pointers[j];
+		neighbor->num_keys += n->num_keys;
+
+		/* The number of pointers is always
+		 * one more than the number of keys.
+		 */
+
+		neighbor->pointers[i] = n->pointers[j];
+		n->num_keys = 0;
+	}
+
+	/* In a leaf, append the keys and pointers of
+	 * n to the neighbor.
+	 * Set the neighbor's last pointer to point to
+	 * what had been n's right neighbor.
+	 */
+
+	else {
+		memcpy(key_at(self, neighbor, neighbor_insertion_index), n->keys,
+				n->num_keys * self->key_size);
+		for(i = neighbor_insertion_index, j = 0; j < n->num_keys; i++, j++)
+			neighbor->pointers[i] = n->pointers[j];
+		neighbor->num_keys += n->num_keys;
+		neighbor->pointers[self->order - 1] = n->pointers[self->order - 1];
+	}
+	node_update_heads(self, neighbor);
+
+	/* n is now the right one of the two, so its
+	 * pointer in the parent follows the neighbor's.
+	 */
+
+	delete_entry(self, path, level - 1, neighbor_index == -1 ? 1 : neighbor_index + 1);
+	free_node(self, n);
+}
+
+/* Redistributes entries between two nodes when
+ * one has become too small after deletion
+ * but its neighbor is too big to append the
+ * small node's entries without exceeding the
+ * maximum
+ */
+static void redistribute_nodes(struct bpt* self, node* parent, node* n, node* neighbor,
+		int neighbor_index, int k_prime_index, void* k_prime) {
+	int i;
+
+	/* Case: n has a neighbor to the left.
+	 * Pull the neighbor's last key-pointer pair over
+	 * from the neighbor's right end to n's left end.
+	 */
+
+	if(neighbor_index != -1) {
+		if(!n->is_leaf) n->pointers[n->num_keys + 1] = n->pointers[n->num_keys];
+		key_move(self, n, 1, 0, n->num_keys);
+		for(i = n->num_keys; i > 0; i--)
+			n->pointers[i] = n->pointers[i - 1];
+		if(!n->is_leaf) {
+			n->pointers[0] = neighbor->pointers[neighbor->num_keys];
+			neighbor->pointers[neighbor->num_keys] = NULL;
+			key_copy(self, key_at(self, n, 0), k_prime);
+			key_copy(self, key_at(self, parent, k_prime_index),
+					key_at(self, neighbor, neighbor->num_keys - 1));
+		} else {
+			n->pointers[0] = neighbor->pointers[neighbor->num_keys - 1];
+			neighbor->pointers[neighbor->num_keys - 1] = NULL;
+			key_copy(self, key_at(self, n, 0), key_at(self, neighbor, neighbor->num_keys - 1));
+			key_copy(self, key_at(self, parent, k_prime_index), key_at(self, n, 0));
+		}
+	}
+
+	/* Case: n is the leftmost child.
+	 * Take a key-pointer pair from the neighbor to the right.
+	 * Move the neighbor's leftmost key-pointer pair
+	 * to n's rightmost position.
+	 */
+
+	else {
+		if(n->is_leaf) {
+			key_copy(self, key_at(self, n, n->num_keys), key_at(self, neighbor, 0));
+			n->pointers[n->num_keys] = neighbor->pointers[0];
+			key_copy(self, key_at(self, parent, k_prime_index), key_at(self, neighbor, 1));
+		} else {
+			key_copy(self, key_at(self, n, n->num_keys), k_prime);
+			n->pointers[n->num_keys + 1] = neighbor->pointers[0];
+			key_copy(self, key_at(self, parent, k_prime_index), key_at(self, neighbor, 0));
+		}
+		key_move(self, neighbor, 0, 1, neighbor->num_keys - 1);
+		for(i = 0; i < neighbor->num_keys - 1; i++)
+			neighbor->pointers[i] = neighbor->pointers[i + 1];
+		if(!n->is_leaf) neighbor->pointers[i] = neighbor->pointers[i + 1];
+	}
+
+	/* n now has one more key and one more pointer;
+	 * the neighbor has one fewer of each.
+	 */
+
+	n->num_keys++;
+	neighbor->num_keys--;
+	node_update_heads(self, n);
+	node_update_heads(self, neighbor);
+	node_update_heads(self, parent);
+}
+
+/* Deletes an entry from the B+ tree.
+ * Removes the value and its key and pointer
+ * from the leaf, and then makes all appropriate
+ * changes to preserve the B+ tree properties.
+ */
+static void delete_entry(struct bpt* self, struct path* path, int level, int index) {
+	// Remove key and pointer from node.
+
+	remove_entry_from_node(self, path->nodes[level], index);
+	rebalance_node(self, path, level);
+}
+
+/* Restores the minimum occupancy of a node
+ * that lost entries, by one coalescence or
+ * redistribution with a neighbor.  A node far
+ * below the minimum may need several calls.
+ */
+static void rebalance_node(struct bpt* self, struct path* path, int level) {
+	int order = self->order;
+	node* n = path->nodes[level];
+	node* parent;
+	int min_keys;
+	node* neighbor;
+	int neighbor_index;
+	int k_prime_index;
+	void* k_prime;
+	int capacity;
+
+	/* Case:  deletion from the root.
+	*/
+
+	if(level == 0) {
+		adjust_root(self);
+		return;
+	}
+
+	/* Case:  deletion from a node below the root.
+	 * (Rest of function body.)
+	 */
+
+	/* Determine minimum allowable size of node,
+	 * to be preserved after deletion.
+	 */
+
+	min_keys = n->is_leaf ? cut(order - 1) : cut(order) - 1;
+
+	/* Case:  node stays at or above minimum.
+	 * (The simple case.)
+	 */
+
+	if(n->num_keys >= min_keys) return;
+
+	/* Case:  node falls below minimum.
+	 * Either coalescence or redistribution
+	 * is needed.
+	 */
+
+	/* Find the appropriate neighbor node with which
+	 * to coalesce.
+	 * Also find the key (k_prime) in the parent
+	 * between the pointer to node n and the pointer
+	 * to the neighbor.  k_prime points into the parent,
+	 * which is read before it is changed.
+	 */
+
+	parent = path->nodes[level - 1];
+	neighbor_index = path->slots[level - 1] - 1;
+	k_prime_index = neighbor_index == -1 ? 0 : neighbor_index;
+	k_prime = key_at(self, parent, k_prime_index);
+	neighbor = own_child(self, parent, neighbor_index == -1 ? 1 : neighbor_index);
+
+	capacity = n->is_leaf ? order : order - 1;
+
+	/* Coalescence.*/
+
+	if(neighbor->num_keys + n->num_keys < capacity)
+		coalesce_nodes(self, path, level, neighbor, neighbor_index, k_prime);
+	/* Redistribution.*/
+	else
+		redistribute_nodes(self, parent, n, neighbor, neighbor_index, k_prime_index,
+				k_prime);
+}
+
+/* Master deletion function.
+ * Returns false if the key is not present.
+ */
+static bool delete(struct bpt* self, void* key) {
+	struct path path;
+	node* key_leaf;
+	void* key_pointer;
+	int i;
+
+	key_leaf = find_path(self, key, &path);
+	if(key_leaf == NULL)
+		return false;
+
+	i = node_rank_lt(self, key_leaf, key);
+	if(i == key_leaf->num_keys || key_compare(self, key_at(self, key_leaf, i), key) != 0)
+		return false;
+
+	own_path(self, &path);
+	key_pointer = path.nodes[path.depth]->pointers[i];
+	delete_entry(self, &path, path.depth, i);
+	if(self->flags & BPT_RECORDS)
+		free(key_pointer);
+	return true;
+}
+
+/* Unlinks the node at the given level of the path, left
+ * without entries, from its parent and frees it, cascading
+ * to a parent left without children.  The separator next
+ * to the child goes with it, the one on its left unless it
+ * is the leftmost child.  Returns the deepest level still
+ * valid, whose slot is moved back onto the previous child
+ * so the walk goes on with the child that took its place;
+ * -1 once the tree is empty.
+ */
+static int detach_node(struct bpt* self, struct path* path, int level) {
+	free_node(self, path->nodes[level]);
+	if(level == 0) {
+		self->root = NULL;
+		return -1;
+	}
+
+	node* parent = path->nodes[level - 1];
+	int i = path->slots[level - 1];
+	if(parent->num_keys == 0)
+		return detach_node(self, path, level - 1);
+
+	int key_index = i > 0 ? i - 1 : 0;
+	key_move(self, parent, key_index, key_index + 1, parent->num_keys - key_index - 1);
+	for(; i < parent->num_keys; i++)
+		parent->pointers[i] = parent->pointers[i + 1];
+	parent->pointers[i] = NULL;
+	parent->num_keys--;
+	node_update_heads(self, parent);
+	path->slots[level - 1]--;
+	return level - 1;
+}
+
+/* Moves the path on to the next leaf in key order, going
+ * back up from the given level only as far as a node with
+ * children left.  The caller knows a next leaf exists.
+ */
+static node* next_leaf_on_path(struct path* path, int level) {
+	int l = level == path->depth ? level - 1 : level;
+	while(path->slots[l] >= path->nodes[l]->num_keys)
+		l--;
+
+	path->slots[l]++;
+	for(; l < path->depth; l++) {
+		path->nodes[l + 1] = path->nodes[l]->pointers[path->slots[l]];
+		path->slots[l + 1] = 0;
+	}
+	return path->nodes[path->depth];
+}
+
+/* Records the path towards key down to the shallowest
+ * node that needs rebalancing and returns its level,
+ * or -1 if none does.
+ */
+static int find_underfull(struct bpt* self, void* key, struct path* path) {
+	node* c = self->root;
+	path->depth = 0;
+	while(c != NULL) {
+		path->nodes[path->depth] = c;
+		if(path->depth == 0 ? !c->is_leaf && c->num_keys == 0
+				: c->num_keys < (c->is_leaf ? cut(self->order - 1) : cut(self->order) - 1))
+			return path->depth;
+		if(c->is_leaf)
+			break;
+		path->slots[path->depth] = node_rank_le(self, c, key);
+		c = (node*)c->pointers[path->slots[path->depth++]];
+	}
+	return -1;
+}
+
+/* Deletes every key from key_start to key_end in two
+ * passes.  The first walks the leaves once, along the
+ * descent path so that parents are at hand, and strips
+ * the range out of each leaf, unlinking leaves it empties,
+ * without any rebalancing.  A node that is neither emptied
+ * nor untouched then spans key_start or key_end, so the
+ * second pass rebalances only along those two paths,
+ * top-down so that every node being fixed has a parent
+ * with a neighbor to offer.
+ * Returns the number of keys deleted.
+ */
+static size_t delete_range(struct bpt* self, void* key_start, void* key_end) {
+	int order = self->order;
+	size_t num_removed = 0;
+	struct path path;
+	node* leaf = find_path(self, key_start, &path);
+	if(leaf == NULL)
+		return 0;
+
+	own_path(self, &path);
+	leaf = path.nodes[path.depth];
+	// leaves shared with snapshots are not chained, there is no link to mend
+	node* kept = self->shared ? NULL : prev_leaf(self, leaf);
+	int i = node_rank_lt(self, leaf, key_start);
+	for(;;) {
+		int num_keys = leaf->num_keys;
+		int j = node_rank_le(self, leaf, key_end);
+		bool has_next = next_leaf(self, leaf) != NULL;
+		node* next = leaf->pointers[order - 1];
+		int level = path.depth;
+
+		if(j > i) {
+			if(self->flags & BPT_RECORDS)
+				for(int k = i; k < j; k++)
+					free(leaf->pointers[k]);
+			key_move(self, leaf, i, j, num_keys - j);
+			memmove(&leaf->pointers[i], &leaf->pointers[j], (num_keys - j) * sizeof(void*));
+			leaf->num_keys -= j - i;
+			for(int k = leaf->num_keys; k < num_keys; k++)
+				leaf->pointers[k] = NULL;
+			node_update_heads(self, leaf);
+			num_removed += j - i;
+		}
+
+		if(leaf->num_keys == 0) {
+			if(kept != NULL)
+				kept->pointers[order - 1] = next;
+			level = detach_node(self, &path, path.depth);
+		} else if(!self->shared)
+			kept = leaf;
+
+		if(j < num_keys || !has_next || level < 0)
+			break;
+		next_leaf_on_path(&path, level);
+		own_path(self, &path);
+		leaf = path.nodes[path.depth];
+		i = 0;
+	}
+
+	int level;
+	while((level = find_underfull(self, key_start, &path)) >= 0
+			|| (level = find_underfull(self, key_end, &path)) >= 0) {
+		own_path(self, &path);
+		rebalance_node(self, &path, level);
+	}
+	return num_removed;
+}
+
+// BULK LOADING.
+
+/* Number of entries to put into the next node when
+ * remaining entries are packed left to right aiming
+ * at per entries a node.  Keeps every node between
+ * lo and hi entries by merging a too small tail into
+ * the current node, or halving the last two nodes
+ * when the merged tail would not fit.
+ */
+static size_t bulk_group_size(size_t remaining, size_t per, size_t lo, size_t hi) {
+	if(remaining <= per || remaining - per >= lo)
+		return remaining <= per ? remaining : per;
+	if(remaining <= hi)
+		return remaining;
+	return remaining - remaining / 2;
+}
+
+/* Builds the tree bottom-up from strictly increasing
+ * keys: full leaves first, then each internal level
+ * over the one below, so every key is written once
+ * and no node is ever split.
+ */
+static bool bulk_load(struct bpt* self, char* keys, void** values, size_t count,
+		double fill_factor) {
+	int order = self->order;
+	size_t key_size = self->key_size;
+	size_t per, lo, hi, num_nodes, i, j, k;
+	node** level;
+	char* low_keys;
+
+	/* Leaf level.
+	 */
+
+	hi = order - 1;
+	lo = cut(order - 1);
+	per = (size_t)(fill_factor * hi + 0.5);
+	per = per < lo ? lo : per > hi ? hi : per;
+
+	level = malloc((count / lo + 1) * sizeof(node*));
+	low_keys = malloc((count / lo + 1) * key_size);
+	if(level == NULL || low_keys == NULL) {
+		free(level);
+		free(low_keys);
+		return false;
+	}
+
+	num_nodes = 0;
+	for(i = 0; i < count;) {
+		size_t group = bulk_group_size(count - i, per, lo, hi);
+		node* leaf = make_node(self, true);
+		if(leaf == NULL)
+			goto failure;
+
+		if(num_nodes)
+			level[num_nodes - 1]->pointers[order - 1] = leaf;
+		level[num_nodes] = leaf;
+		memcpy(low_keys + num_nodes++ * key_size, keys + i * key_size, key_size);
+
+		for(j = 0; j < group; j++, i++) {
+			void* pointer = values[i];
+			if(self->flags & BPT_RECORDS) {
+				record* r = (record*)malloc(sizeof(record));
+				if(r == NULL)
+					goto failure;
+
+				r->value = values[i];
+				pointer = r;
+			}
+			memcpy(key_at(self, leaf, j), keys + i * key_size, key_size);
+			leaf->pointers[j] = pointer;
+			leaf->num_keys++;
+		}
+		node_update_heads(self, leaf);
+	}
+
+	/* Internal levels, until a single root remains.
+	 * A node holds children, so bounds are counted
+	 * in pointers rather than keys.
+	 */
+
+	hi = order;
+	lo = cut(order);
+	per = (size_t)(fill_factor * hi + 0.5);
+	per = per < lo ? lo : per > hi ? hi : per;
+
+	while(num_nodes > 1) {
+		size_t num_parents = 0;
+		for(i = 0; i < num_nodes;) {
+			size_t group = bulk_group_size(num_nodes - i, per, lo, hi);
+			node* parent = make_node(self, false);
+			if(parent == NULL) {
+				/* Parents built so far own their children;
+				 * the rest of this level is still loose.
+				 */
+				for(k = 0; k < num_parents; k++)
+					destroy_tree(self, level[k]);
+				for(k = i; k < num_nodes; k++)
+					destroy_tree(self, level[k]);
+				free(level);
+				free(low_keys);
+				return false;
+			}
+
+			for(j = 0; j < group; j++)
+				parent->pointers[j] = level[i + j];
+			memcpy(parent->keys, low_keys + (i + 1) * key_size, (group - 1) * key_size);
+			parent->num_keys = group - 1;
+			node_update_heads(self, parent);
+
+			memmove(low_keys + num_parents * key_size, low_keys + i * key_size, key_size);
+			level[num_parents++] = parent;
+			i += group;
+		}
+		num_nodes = num_parents;
+	}
+
+	self->root = level[0];
+	free(level);
+	free(low_keys);
+	return true;
+
+failure:
+	for(k = 0; k < num_nodes; k++)
+		destroy_tree(self, level[k]);
+	free(level);
+	free(low_keys);
+	return false;
+}
+
+// FILE STORAGE.
+
+static size_t page_slots_offset(struct bpt* self) {
+	size_t keys_size = (self->order - 1) * self->key_size;
+	keys_size = (keys_size + BPT_PAGE_KEYS_ALIGN - 1) / BPT_PAGE_KEYS_ALIGN * BPT_PAGE_KEYS_ALIGN;
+	return sizeof(struct bpt_page) + keys_size;
+}
+
+/* Pages are a power of two in size, so none straddles two OS pages
+ * and faulting a node in reads it whole.
+ */
+static size_t page_block_size(struct bpt* self) {
+	size_t needed = page_slots_offset(self) + self->order * sizeof(uint64_t);
+	size_t size = BPT_NODE_ALIGN;
+	while(size < needed || size < sizeof(struct bpt_file_header))
+		size *= 2;
+	return size;
+}
+
+static inline struct bpt_page* page_at(struct bpt* self, uint64_t page) {
+	return (struct bpt_page*)((char*)self->map + page * self->page_size);
+}
+
+static inline char* page_keys(struct bpt_page* p) {
+	return (char*)(p + 1);
+}
+
+static inline uint64_t* page_slots(struct bpt* self, struct bpt_page* p) {
+	return (uint64_t*)((char*)p + page_slots_offset(self));
+}
+
+static size_t count_nodes(node* n) {
+	size_t count = 1;
+	if(!n->is_leaf)
+		for(int i = 0; i <= n->num_keys; i++)
+			count += count_nodes(n->pointers[i]);
+	return count;
+}
+
+/* Writes the header page and then every node, level by level from the
+ * root. Breadth first order keeps the upper levels, which every lookup
+ * reads, together at the front of the file, numbers the children of a
+ * node consecutively and leaves the leaves in key order at the end, so
+ * page numbers follow from queue positions alone.
+ */
+static bool save_pages(struct bpt* self, FILE* file) {
+	size_t page_size = page_block_size(self);
+	size_t num_nodes = self->root ? count_nodes(self->root) : 0;
+	node** queue = malloc((num_nodes + 1) * sizeof(node*));
+	char* buffer = calloc(1, page_size);
+	bool saved = false;
+
+	if(queue == NULL || buffer == NULL)
+		goto done;
+
+	struct bpt_file_header* header = (struct bpt_file_header*)buffer;
+	memcpy(header->magic, BPT_FILE_MAGIC, sizeof(header->magic));
+	header->version = BPT_FILE_VERSION;
+	header->order = self->order;
+	header->key_type = self->key_type;
+	header->key_size = self->key_size;
+	header->page_size = page_size;
+	header->num_pages = num_nodes + 1;
+	header->root = num_nodes ? 1 : 0;
+	header->size = self->size;
+	if(fwrite(buffer, page_size, 1, file) != 1)
+		goto done;
+
+	size_t tail = 0;
+	if(num_nodes)
+		queue[tail++] = self->root;
+	for(size_t head = 0; head < tail; head++) {
+		node* n = queue[head];
+		struct bpt_page* p = (struct bpt_page*)buffer;
+		uint64_t* slots = page_slots(self, p);
+
+		memset(buffer, 0, page_size);
+		p->num_keys = n->num_keys;
+		p->is_leaf = n->is_leaf;
+		memcpy(page_keys(p), n->keys, n->num_keys * self->key_size);
+		if(n->is_leaf) {
+			p->next = head + 1 < num_nodes ? head + 2 : 0;
+			for(int i = 0; i < n->num_keys; i++) {
+				void* value = self->flags & BPT_RECORDS ? ((record*)n->pointers[i])->value : n->pointers[i];
+				slots[i] = (uintptr_t)value;
+			}
+		} else {
+			for(int i = 0; i <= n->num_keys; i++) {
+				slots[i] = tail + 1;
+				queue[tail++] = n->pointers[i];
+			}
+		}
+
+		if(fwrite(buffer, page_size, 1, file) != 1)
+			goto done;
+	}
+	saved = true;
+
+done:
+	free(queue);
+	free(buffer);
+	return saved;
+}
+
+static struct bpt_page* page_find_leaf(struct bpt* self, void* key) {
+	if(self->root_page == 0)
+		return NULL;
+
+	struct bpt_page* p = page_at(self, self->root_page);
+	while(!p->is_leaf)
+		p = page_at(self, page_slots(self, p)[keys_rank_le(self, page_keys(p), p->num_keys, key)]);
+	return p;
+}
+
+static struct bpt_page* page_edge_leaf(struct bpt* self, bool last) {
+	if(self->root_page == 0)
+		return NULL;
+
+	struct bpt_page* p = page_at(self, self->root_page);
+	while(!p->is_leaf)
+		p = page_at(self, page_slots(self, p)[last ? p->num_keys : 0]);
+	return p;
+}
+
+/* Same descent as prev_leaf(). */
+static struct bpt_page* page_prev_leaf(struct bpt* self, struct bpt_page* leaf) {
+	struct bpt_page* p = page_at(self, self->root_page);
+	struct bpt_page* turn = NULL;
+	int turn_index = 0;
+	void* key = page_keys(leaf);
+
+	while(!p->is_leaf) {
+		int i = keys_rank_le(self, page_keys(p), p->num_keys, key);
+		if(i > 0)
+			turn = p, turn_index = i;
+		p = page_at(self, page_slots(self, p)[i]);
+	}
+	if(turn == NULL)
+		return NULL;
+
+	p = page_at(self, page_slots(self, turn)[turn_index - 1]);
+	while(!p->is_leaf)
+		p = page_at(self, page_slots(self, p)[p->num_keys]);
+	return p;
+}
+
+static void* page_get(struct bpt* self, void* key) {
+	struct bpt_page* leaf = page_find_leaf(self, key);
+	if(leaf == NULL)
+		return NULL;
+
+	int i = keys_rank_lt(self, page_keys(leaf), leaf->num_keys, key);
+	if(i == (int)leaf->num_keys || key_compare(self, page_keys(leaf) + i * self->key_size, key) != 0)
+		return NULL;
+	return (void*)(uintptr_t)page_slots(self, leaf)[i];
+}
+
+static bool page_cursor_seek(struct bpt* self, struct bpt_cursor* cursor, void* key) {
+	cursor->tree = self;
+	cursor->leaf = NULL;
+	cursor->index = 0;
+	if(key == NULL) {
+		cursor->page = page_edge_leaf(self, false);
+		return cursor->page != NULL;
+	}
+
+	cursor->page = page_find_leaf(self, key);
+	if(cursor->page == NULL)
+		return false;
+
+	cursor->index = keys_rank_lt(self, page_keys(cursor->page), cursor->page->num_keys, key);
+	if(cursor->index == (int)cursor->page->num_keys) {
+		cursor->page = cursor->page->next ? page_at(self, cursor->page->next) : NULL;
+		cursor->index = 0;
+	}
+	return cursor->page != NULL;
+}
+
+static bool page_cursor_seek_last(struct bpt* self, struct bpt_cursor* cursor, void* key) {
+	cursor->tree = self;
+	cursor->leaf = NULL;
+	if(key == NULL) {
+		cursor->page = page_edge_leaf(self, true);
+		cursor->index = cursor->page ? (int)cursor->page->num_keys - 1 : 0;
+		return cursor->page != NULL;
+	}
+
+	cursor->page = page_find_leaf(self, key);
+	if(cursor->page == NULL)
+		return false;
+
+	cursor->index = keys_rank_le(self, page_keys(cursor->page), cursor->page->num_keys, key) - 1;
+	if(cursor->index < 0) {
+		cursor->page = page_prev_leaf(self, cursor->page);
+		cursor->index = cursor->page ? (int)cursor->page->num_keys - 1 : 0;
+	}
+	return cursor->page != NULL;
+}
+
+static bool page_cursor_next(struct bpt_cursor* self) {
+	if(self->page == NULL)
+		return false;
+
+	if(++self->index == (int)self->page->num_keys) {
+		self->page = self->page->next ? page_at(self->tree, self->page->next) : NULL;
+		self->index = 0;
+	}
+	return self->page != NULL;
+}
+
+static bool page_cursor_prev(struct bpt_cursor* self) {
+	if(self->page == NULL)
+		return false;
+
+	if(--self->index < 0) {
+		self->page = page_prev_leaf(self->tree, self->page);
+		self->index = self->page ? (int)self->page->num_keys - 1 : 0;
+	}
+	return self->page != NULL;
+}
+
+static void* page_cursor_key(struct bpt_cursor* self) {
+	return self->page ? page_keys(self->page) + self->index * self->tree->key_size : NULL;
+}
+
+static void* page_cursor_value(struct bpt_cursor* self) {
+	return self->page ? (void*)(uintptr_t)page_slots(self->tree, self->page)[self->index] : NULL;
+}
+
+// WRITE-AHEAD LOG.
+
+/* Writes the tree to a page file, flushed to the disk before
+ * returning when durable.  A failed save leaves no file behind.
+ */
+static bool save_file(struct bpt* self, const char* path, bool durable) {
+	FILE* file = fopen(path, "wb");
+	if(file == NULL)
+		return false;
+
+	bool saved = self->map ? fwrite(self->map, self->map_size, 1, file) == 1 : save_pages(self, file);
+	if(durable)
+		saved = saved && fflush(file) == 0 && fsync(fileno(file)) == 0;
+	saved = fclose(file) == 0 && saved;
+	if(!saved)
+		unlink(path);
+	return saved;
+}
+
+/* Makes the creation or renaming of a file durable by
+ * flushing the directory holding it.
+ */
+static bool sync_directory(const char* path) {
+	const char* slash = strrchr(path, '/');
+	char* dir_path = slash == NULL ? strdup(".") : strndup(path, slash == path ? 1 : slash - path);
+	if(dir_path == NULL)
+		return false;
+
+	int fd = open(dir_path, O_RDONLY);
+	free(dir_path);
+	bool synced = fd >= 0 && fsync(fd) == 0;
+	if(fd >= 0)
+		close(fd);
+	return synced;
+}
+
+/* FNV-1a, enough to tell a torn record from a whole one. */
+static uint32_t log_checksum(const char* data, size_t size) {
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < size; i++)
+		hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+	return hash;
+}
+
+/* Buffers a log record of a mutation already applied to the tree and
+ * commits the whole group once it is group_size records long.  The
+ * mutation happened whatever that commit does: a failed group stays
+ * buffered for the next commit to retry, bpt_commit() reports it.
+ */
+static void log_append(struct bpt* self, enum bpt_log_op op, void* key, void* key_end, void* value) {
+	struct bpt_log* log = self->log;
+	struct bpt_log_record record = {0, op, (uint64_t)(uintptr_t)value};
+	size_t size = sizeof(record) + (key_end ? 2 : 1) * self->key_size;
+	if(log->lost)
+		return;
+
+	if(log->used + size > log->capacity) {
+		size_t capacity = log->capacity * 2 < log->used + size ? log->used + size : log->capacity * 2;
+		char* buffer = realloc(log->buffer, capacity);
+		if(buffer != NULL) {
+			log->buffer = buffer;
+			log->capacity = capacity;
+		} else if(!bpt_commit(self) || size > log->capacity) {
+			// without room to buffer the record, the change can never be logged:
+			// later commits and checkpoints fail and the files keep the last committed state
+			log->lost = true;
+			return;
+		}
+	}
+
+	char* r = log->buffer + log->used;
+	memcpy(r, &record, sizeof(record));
+	memcpy(r + sizeof(record), key, self->key_size);
+	if(key_end)
+		memcpy(r + sizeof(record) + self->key_size, key_end, self->key_size);
+	record.checksum = log_checksum(r + sizeof(record.checksum), size - sizeof(record.checksum));
+	memcpy(r, &record.checksum, sizeof(record.checksum));
+	log->used += size;
+
+	if(++log->pending >= log->group_size && log->group_size)
+		bpt_commit(self);
+}
+
+/* Replays the records of a log over a tree that does not log yet and
+ * returns the offset they end at: the log size unless a crash tore the
+ * last record.  Returns -1 if the log cannot be read.
+ */
+static off_t log_replay(struct bpt* self, int fd, off_t size) {
+	size_t key_size = self->key_size;
+	off_t start = sizeof(struct bpt_log_header);
+	size_t length = size - start;
+	char* data = malloc(length + 1);
+	if(data == NULL)
+		return -1;
+
+	for(size_t done = 0; done < length;) {
+		ssize_t n = pread(fd, data + done, length - done, start + done);
+		if(n <= 0) {
+			free(data);
+			return -1;
+		}
+		done += n;
+	}
+
+	size_t i = 0;
+	while(length - i >= sizeof(struct bpt_log_record)) {
+		struct bpt_log_record record;
+		memcpy(&record, data + i, sizeof(record));
+		size_t record_size = sizeof(record) + (record.op == BPT_LOG_REMOVE_RANGE ? 2 : 1) * key_size;
+		if(record.op < BPT_LOG_PUT || record.op > BPT_LOG_REMOVE_RANGE || record_size > length - i
+				|| log_checksum(data + i + sizeof(record.checksum), record_size - sizeof(record.checksum))
+					!= record.checksum)
+			break;
+
+		char* key = data + i + sizeof(record);
+		switch(record.op) {
+		case BPT_LOG_PUT:
+			bpt_put(self, key, (void*)(uintptr_t)record.value);
+			break;
+		case BPT_LOG_REMOVE:
+			bpt_remove(self, key);
+			break;
+		default:
+			bpt_remove_range(self, key, key + key_size);
+		}
+		i += record_size;
+	}
+
+	free(data);
+	return start + i;
+}
+
+/* Opens or creates the log of the page file at path, replays it and
+ * attaches it to the tree.
+ */
+static bool log_open(struct bpt* self, const char* path, size_t group_size) {
+	struct bpt_log_header header, expected;
+	struct stat st;
+
+	memset(&expected, 0, sizeof(expected));
+	memcpy(expected.magic, BPT_LOG_MAGIC, sizeof(expected.magic));
+	expected.version = BPT_LOG_VERSION;
+	expected.key_type = self->key_type;
+	expected.key_size = self->key_size;
+
+	size_t length = strlen(path);
+	char* log_path = malloc(length + sizeof(".wal"));
+	if(log_path == NULL)
+		return false;
+	memcpy(log_path, path, length);
+	memcpy(log_path + length, ".wal", sizeof(".wal"));
+	int fd = open(log_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	free(log_path);
+	if(fd < 0)
+		return false;
+
+	off_t end = sizeof(header);
+	bool opened = fstat(fd, &st) == 0;
+	if(opened && st.st_size < (off_t)sizeof(header)) {
+		// new, or torn while being created
+		opened = ftruncate(fd, 0) == 0 && write(fd, &expected, sizeof(expected)) == sizeof(expected)
+			&& fdatasync(fd) == 0 && sync_directory(path);
+	} else if(opened) {
+		end = -1;
+		if(pread(fd, &header, sizeof(header), 0) == sizeof(header)
+				&& memcmp(&header, &expected, sizeof(header)) == 0)
+			end = log_replay(self, fd, st.st_size);
+		opened = end >= 0 && (end == st.st_size || (ftruncate(fd, end) == 0 && fdatasync(fd) == 0));
+	}
+
+	struct bpt_log* log = opened ? calloc(1, sizeof(struct bpt_log)) : NULL;
+	if(log != NULL) {
+		log->path = strdup(path);
+		log->buffer = malloc(BPT_LOG_BUFFER);
+	}
+	if(log == NULL || log->path == NULL || log->buffer == NULL) {
+		if(log != NULL)
+			free(log->path), free(log->buffer), free(log);
+		close(fd);
+		return false;
+	}
+
+	log->fd = fd;
+	log->end = end;
+	log->capacity = BPT_LOG_BUFFER;
+	log->group_size = group_size;
+	self->log = log;
+	return true;
+}
+
+/* Commits what is pending and detaches the log from the tree. */
+static void log_close(struct bpt* self) {
+	struct bpt_log* log = self->log;
+	bpt_commit(self);
+	close(log->fd);
+	free(log->path);
+	free(log->buffer);
+	free(log);
+	self->log = NULL;
+}
+
+/* Drops a reference to n, freeing it along with the
+ * references it holds once nothing refers to it.
+ */
+static void destroy_tree(struct bpt* self, node* n) {
+	if(n == NULL || __atomic_sub_fetch(&n->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	if(n->is_leaf) {
+		if(self->flags & BPT_RECORDS)
+			for(int i = 0; i < n->num_keys; i++)
+				free(n->pointers[i]); // delete records
+	} else {
+		for(int i = 0; i < n->num_keys + 1; i++)
+			destroy_tree(self, n->pointers[i]); // cascade intermediate nodes
+	}
+	free_node(self, n);
+}
+
+#ifndef NDBUG
+#include <assert.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <time.h>
+/* Verifies B+ tree invariants below n: sorted keys inside the parent's
+ * bounds (lo inclusive, hi exclusive, NULL for unbounded), occupancy,
+ * equal leaf depth and the leaf chain. Returns the number of keys.
+ */
+static size_t check_node(struct bpt* self, node* n, void* lo, void* hi,
+		int depth, int* leaf_depth, node** prev_leaf) {
+	int order = self->order;
+	assert(n->num_keys <= order - 1);
+	if(depth > 0)
+		assert(n->num_keys >= (n->is_leaf ? cut(order - 1) : cut(order) - 1));
+	for(int i = 0; i < n->num_keys; i++) {
+		assert(lo == NULL || key_compare(self, key_at(self, n, i), lo) >= 0);
+		assert(hi == NULL || key_compare(self, key_at(self, n, i), hi) < 0);
+		assert(i == 0 || key_compare(self, key_at(self, n, i - 1), key_at(self, n, i)) < 0);
+	}
+	if(self->key_type == BPT_KEY_BINARY && n->num_keys > 0) {
+		char* first = key_at(self, n, 0);
+		char* last = key_at(self, n, n->num_keys - 1);
+		assert(memcmp(first, last, n->prefix_len) == 0);
+		assert(memcmp(first, node_prefix(self, n), n->prefix_len) == 0);
+		assert(n->prefix_len == self->key_size || n->prefix_len == UINT16_MAX
+				|| first[n->prefix_len] != last[n->prefix_len]);
+		for(int i = 0; i < n->num_keys; i++)
+			assert(node_heads(n)[i] == key_head(self, key_at(self, n, i), n->prefix_len));
+	}
+
+	if(n->is_leaf) {
+		if(*leaf_depth < 0)
+			*leaf_depth = depth;
+		assert(*leaf_depth == depth);
+		if(*prev_leaf != NULL)
+			assert(next_leaf(self, *prev_leaf) == n);
+		*prev_leaf = n;
+		return n->num_keys;
+	}
+
+	size_t num_keys = 0;
+	for(int i = 0; i <= n->num_keys; i++)
+		num_keys += check_node(self, n->pointers[i],
+				i == 0 ? lo : key_at(self, n, i - 1), i == n->num_keys ? hi : key_at(self, n, i),
+				depth + 1, leaf_depth, prev_leaf);
+	return num_keys;
+}
+
+static void check_tree(struct bpt* self) {
+	if(self->root == NULL) {
+		assert(self->size == 0);
+		return;
+	}
+
+	int leaf_depth = -1;
+	node* prev_leaf = NULL;
+	assert(check_node(self, self->root, NULL, NULL, 0, &leaf_depth, &prev_leaf) == self->size);
+	assert(next_leaf(self, prev_leaf) == NULL);
+}
+
+/* Verifies an int keyed tree holds exactly the keys k below num_keys
+ * with a nonzero values[k], mapped to that value, scanning it both ways.
+ */
+static void check_contents(struct bpt* self, const int* values, int num_keys) {
+	struct bpt_cursor cursor;
+	size_t size = 0;
+	for(int k = 0; k < num_keys; k++) {
+		assert(bpt_get(self, &k) == (void*)(intptr_t)values[k]);
+		size += values[k] != 0;
+	}
+	assert(bpt_size(self) == size);
+	check_tree(self);
+
+	int k = -1;
+	for(bool found = bpt_cursor_seek(self, &cursor, NULL); found; found = bpt_cursor_next(&cursor)) {
+		while(values[++k] == 0);
+		assert(*(int*)bpt_cursor_key(&cursor) == k);
+		assert(bpt_cursor_value(&cursor) == (void*)(intptr_t)values[k]);
+	}
+	for(k++; k < num_keys; k++)
+		assert(values[k] == 0);
+	k = num_keys;
+	for(bool found = bpt_cursor_seek_last(self, &cursor, NULL); found; found = bpt_cursor_prev(&cursor)) {
+		while(values[--k] == 0);
+		assert(*(int*)bpt_cursor_key(&cursor) == k);
+	}
+}
+
+/* Seconds on a monotonic clock, for timings that include waiting on the disk. */
+static double wall_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Orders 12 byte keys by their last 4 bytes, then by the first 8. */
+struct tagged_key {
+	uint64_t id;
+	uint32_t tag;
+};
+
+static int compare_tagged(void* lhs, void* rhs) {
+	struct tagged_key a, b;
+	memcpy(&a.id, lhs, 8), memcpy(&a.tag, (char*)lhs + 8, 4);
+	memcpy(&b.id, rhs, 8), memcpy(&b.tag, (char*)rhs + 8, 4);
+	if(a.tag != b.tag)
+		return a.tag < b.tag ? -1 : 1;
+	return (a.id > b.id) - (a.id < b.id);
+}
+
+/* Encodes reference key i (0 <= i < 2000) in the given key type so that
+ * encodings sort the same way as i.
+ */
+static void encode_key(enum bpt_key_type key_type, int i, char* key) {
+	switch(key_type) {
+	case BPT_KEY_INT32:
+		*(int32_t*)key = i - 1000;
+		break;
+	case BPT_KEY_INT64:
+		*(int64_t*)key = (int64_t)(i - 1000) * 10000000000LL;
+		break;
+	case BPT_KEY_UINT64:
+		*(uint64_t*)key = (uint64_t)i * 9000000000000000ULL;
+		break;
+	case BPT_KEY_BINARY:
+		memset(key, 0, 20);
+		key[0] = 'k', key[17] = i >> 8, key[18] = i & 0xff;
+		break;
+	default: {
+		uint64_t id = i % 1000;
+		uint32_t tag = i / 1000;
+		memcpy(key, &id, 8), memcpy(key + 8, &tag, 4);
+	}
+	}
+}
+
+#define URL_KEY_SIZE 64
+
+/* Encodes i as a zero padded URL whose host varies only in one digit
+ * and whose path repeats a long segment before the number, so nodes
+ * spanning hosts share short prefixes and many key heads tie.
+ */
+static void encode_url(int i, char* key) {
+	memset(key, 0, URL_KEY_SIZE);
+	snprintf(key, URL_KEY_SIZE, "https://h%d.example.com/catalog/items/%08d", i % 3, i / 3);
 }
 
+int main(int argc, char** argv) {
+	struct bpt* tree = bpt_create(16, 0);
+
+	// throughput test
+	clock_t b, e;
+	b = clock();
+	for(int i = 0; i < 1000000; ++i)
+		bpt_put(tree, &i, (void*)(intptr_t)4567);
+	e = clock();
+	printf("[INSERT] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	assert(bpt_size(tree) == 1000000);
+
+	b = clock();
+	for(int i = 0; i < 1000000; ++i)
+		assert(bpt_get(tree, &i) == (void*)(intptr_t)4567);
+	e = clock();
+	printf("[FIND] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+
+	b = clock();
+	for(int i = 0; i < 1000000; ++i)
+		bpt_remove(tree, &i);
+	e = clock();
+	printf("[DELETE] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	assert(bpt_size(tree) == 0);
+	bpt_destroy(tree);
+
+	// two trees with different fanouts side by side
+	struct bpt* narrow = bpt_create(3, BPT_RECORDS);
+	struct bpt* wide = bpt_create(64, 0);
+	for(int i = 0; i < 1000; ++i) {
+		assert(bpt_put(narrow, &i, (void*)(intptr_t)(i + 1)));
+		assert(bpt_put(wide, &i, (void*)(intptr_t)(i + 1)));
+	}
+	for(int i = 0; i < 1000; ++i)
+		assert(!bpt_put(narrow, &i, NULL));
+	for(int i = 0; i < 1000; ++i) {
+		assert((intptr_t)bpt_get(narrow, &i) == i + 1);
+		assert((intptr_t)bpt_get(wide, &i) == i + 1);
+	}
+
+	void* values[16];
+	int lo = 100, hi = 199;
+	assert(bpt_get_ranged(wide, &lo, &hi, values, 16) == 16);
+	assert((intptr_t)values[0] == 101 && (intptr_t)values[15] == 116);
+
+	for(int i = 0; i < 1000; i += 2)
+		assert(bpt_remove(narrow, &i));
+	for(int i = 0; i < 1000; i += 2)
+		assert(!bpt_remove(narrow, &i));
+	assert(bpt_size(narrow) == 500 && bpt_size(wide) == 1000);
+	check_tree(narrow);
+	check_tree(wide);
+	for(int i = 0; i < 1000; ++i)
+		assert((intptr_t)bpt_get(narrow, &i) == (i % 2 ? i + 1 : 0));
+
+	// record mode keeps value references stable across splits and merges
+	int probe = 999;
+	void** ref = bpt_get_ref(narrow, &probe);
+	assert(ref && *ref == (void*)(intptr_t)1000);
+	for(int i = 0; i < 1000; i += 2)
+		assert(bpt_put(narrow, &i, NULL));
+	assert(bpt_get_ref(narrow, &probe) == ref);
+	*ref = (void*)(intptr_t)7;
+	assert(bpt_get(narrow, &probe) == (void*)(intptr_t)7);
+
+	bpt_destroy(narrow);
+	bpt_destroy(wide);
+
+	// cursor scans in both directions against a reference bitmap
+	for(int order = 3; order <= 8; ++order) {
+		static bool present[3000];
+		tree = bpt_create(order, order == 5 ? BPT_RECORDS : 0);
+		memset(present, 0, sizeof(present));
+		srand(order);
+		for(int i = 0; i < 4000; ++i) {
+			int key = rand() % 3000;
+			if(rand() % 3)
+				present[key] |= bpt_put(tree, &key, (void*)(intptr_t)(key + 1));
+			else if(bpt_remove(tree, &key))
+				present[key] = false;
+		}
+		check_tree(tree);
+
+		struct bpt_cursor cursor;
+		int expected = -1;
+		for(bool found = bpt_cursor_seek(tree, &cursor, NULL); found; found = bpt_cursor_next(&cursor)) {
+			for(++expected; !present[expected]; ++expected);
+			assert(*(int*)bpt_cursor_key(&cursor) == expected);
+			assert(bpt_cursor_value(&cursor) == (void*)(intptr_t)(expected + 1));
+		}
+		for(++expected; expected < 3000; ++expected)
+			assert(!present[expected]);
+
+		expected = 3000;
+		for(bool found = bpt_cursor_seek_last(tree, &cursor, NULL); found; found = bpt_cursor_prev(&cursor)) {
+			for(--expected; !present[expected]; --expected);
+			assert(*(int*)bpt_cursor_key(&cursor) == expected);
+		}
+		for(--expected; expected >= 0; --expected)
+			assert(!present[expected]);
+
+		for(int key = -1; key <= 3000; ++key) {
+			int next = key < 0 ? 0 : key;
+			while(next < 3000 && !present[next])
+				next++;
+			bool found = bpt_cursor_seek(tree, &cursor, &key);
+			assert(found == (next < 3000));
+			assert(!found || *(int*)bpt_cursor_key(&cursor) == next);
+
+			int prev = key > 2999 ? 2999 : key;
+			while(prev >= 0 && !present[prev])
+				prev--;
+			found = bpt_cursor_seek_last(tree, &cursor, &key);
+			assert(found == (prev >= 0));
+			assert(!found || *(int*)bpt_cursor_key(&cursor) == prev);
+		}
+
+		// the leaf holding key_start may run out before the range does
+		int lo = 1000, hi = 1999, count = 0;
+		for(int key = lo; key <= hi; ++key)
+			count += present[key];
+		void** range = malloc(1000 * sizeof(void*));
+		assert(bpt_get_ranged(tree, &lo, &hi, range, 1000) == count);
+		free(range);
+		bpt_destroy(tree);
+	}
+
+	// range removal against a reference bitmap
+	for(int order = 3; order <= 10; ++order) {
+		static bool present[3000];
+		for(int round = 0; round < 20; ++round) {
+			tree = bpt_create(order, round % 4 == 1 ? BPT_RECORDS : 0);
+			memset(present, 0, sizeof(present));
+			srand(order * 100 + round);
+			for(int i = 0; i < 3000; ++i) {
+				int key = rand() % 3000;
+				present[key] |= bpt_put(tree, &key, (void*)(intptr_t)(key + 1));
+			}
+			for(int r = 0; r < 40 && bpt_size(tree); ++r) {
+				int lo = rand() % 3100 - 50, hi = lo + (r % 4 == 0 ? rand() % 3000 : rand() % 60);
+				size_t expected = 0;
+				for(int key = lo < 0 ? 0 : lo; key <= hi && key < 3000; ++key) {
+					expected += present[key];
+					present[key] = false;
+				}
+				assert(bpt_remove_range(tree, &lo, &hi) == expected);
+				check_tree(tree);
+				if(r % 8 == 7)
+					for(int i = 0; i < 100; ++i) {
+						int key = rand() % 3000;
+						present[key] |= bpt_put(tree, &key, (void*)(intptr_t)(key + 1));
+					}
+			}
+			for(int key = 0; key < 3000; ++key)
+				assert(bpt_get(tree, &key) == (present[key] ? (void*)(intptr_t)(key + 1) : NULL));
+			int lo = 10, hi = 5;
+			assert(bpt_remove_range(tree, &lo, &hi) == 0);
+			lo = INT32_MIN, hi = INT32_MAX;
+			bpt_remove_range(tree, &lo, &hi);
+			assert(bpt_size(tree) == 0 && tree->root == NULL);
+			assert(bpt_remove_range(tree, &lo, &hi) == 0);
+			assert(bpt_put(tree, &lo, NULL));
+			check_tree(tree);
+			bpt_destroy(tree);
+		}
+	}
+
+	// expiring contiguous runs of keys, one by one and by range
+	tree = bpt_create(16, 0);
+	for(int i = 0; i < 1000000; ++i)
+		bpt_put(tree, &i, (void*)(intptr_t)(i + 1));
+	b = clock();
+	for(int i = 0; i < 500000; ++i)
+		assert(bpt_remove(tree, &i));
+	e = clock();
+	printf("[DELETE 500K one by one] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	b = clock();
+	for(int i = 500000; i < 1000000; i += 10000) {
+		int hi = i + 9999;
+		assert(bpt_remove_range(tree, &i, &hi) == 10000);
+	}
+	e = clock();
+	printf("[DELETE 500K by range] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	assert(bpt_size(tree) == 0);
+	bpt_destroy(tree);
+
+	// snapshots keep their contents while the tree changes under them
+	enum { SNAPSHOT_KEYS = 2000, NUM_SNAPSHOTS = 4 };
+	for(int order = 3; order <= 10; order++) {
+		static int values[NUM_SNAPSHOTS + 1][SNAPSHOT_KEYS];
+		struct bpt* snapshots[NUM_SNAPSHOTS];
+		int* live = values[NUM_SNAPSHOTS];
+		tree = bpt_create(order, 0);
+		memset(live, 0, sizeof(values[0]));
+		for(int round = 0; round < 3 * NUM_SNAPSHOTS; round++) {
+			for(int n = 0; n < 1500; n++) {
+				int k = rand() % SNAPSHOT_KEYS;
+				int v = rand() + 1;
+				switch(rand() % 5) {
+				case 0:
+				case 1:
+					assert(bpt_put(tree, &k, (void*)(intptr_t)v) == (live[k] == 0));
+					if(live[k] == 0)
+						live[k] = v;
+					break;
+				case 2:
+					assert(bpt_remove(tree, &k) == (live[k] != 0));
+					live[k] = 0;
+					break;
+				case 3: {
+					void** ref = bpt_get_ref(tree, &k);
+					assert((ref != NULL) == (live[k] != 0));
+					if(ref != NULL)
+						*ref = (void*)(intptr_t)v, live[k] = v;
+					break;
+				}
+				default: {
+					int hi = k + rand() % 20;
+					bpt_remove_range(tree, &k, &hi);
+					for(; k <= hi && k < SNAPSHOT_KEYS; k++)
+						live[k] = 0;
+				}
+				}
+			}
+
+			// snapshots are taken in the first rounds and released in scrambled order later
+			int s = round % NUM_SNAPSHOTS;
+			if(round < NUM_SNAPSHOTS) {
+				snapshots[s] = round == 2 ? bpt_snapshot(snapshots[1]) : bpt_snapshot(tree);
+				assert(snapshots[s] != NULL);
+				memcpy(values[s], round == 2 ? values[1] : live, sizeof(values[0]));
+			} else if(round >= 2 * NUM_SNAPSHOTS) {
+				s = (s * 3 + 1) % NUM_SNAPSHOTS;
+				check_contents(snapshots[s], values[s], SNAPSHOT_KEYS);
+				bpt_destroy(snapshots[s]);
+			}
+			for(int t = 0; t < NUM_SNAPSHOTS && round < 2 * NUM_SNAPSHOTS; t++)
+				if(t <= round)
+					check_contents(snapshots[t], values[t], SNAPSHOT_KEYS);
+			check_contents(tree, live, SNAPSHOT_KEYS);
+		}
+
+		// the first write after the last snapshot is gone relinks the leaves, scans follow the chain again
+		assert(tree->shared);
+		int k = SNAPSHOT_KEYS - 1;
+		if(bpt_remove(tree, &k))
+			live[k] = 0;
+		assert(!tree->shared && tree->sharers == NULL);
+		check_contents(tree, live, SNAPSHOT_KEYS);
+		for(k = 0; k < SNAPSHOT_KEYS; k += 2)
+			if(live[k] == 0 && bpt_put(tree, &k, (void*)(intptr_t)(k + 1)))
+				live[k] = k + 1;
+		check_contents(tree, live, SNAPSHOT_KEYS);
+		bpt_destroy(tree);
+	}
+
+	// snapshots are read-only and record trees cannot take them
+	tree = bpt_create(4, 0);
+	for(int i = 0; i < 100; i++)
+		bpt_put(tree, &i, (void*)(intptr_t)(i + 1));
+	struct bpt* snapshot = bpt_snapshot(tree);
+	int zero = 0, hundred = 100;
+	assert(!bpt_put(snapshot, &hundred, NULL) && !bpt_remove(snapshot, &zero));
+	assert(bpt_remove_range(snapshot, &zero, &hundred) == 0);
+	assert(bpt_get_ref(snapshot, &zero) == NULL && bpt_get(snapshot, &zero) == (void*)(intptr_t)1);
+	bpt_destroy(tree);
+	assert(bpt_get(snapshot, &zero) == (void*)(intptr_t)1 && bpt_size(snapshot) == 100);
+	bpt_destroy(snapshot);
+	tree = bpt_create(4, BPT_RECORDS);
+	assert(bpt_snapshot(tree) == NULL);
+	bpt_destroy(tree);
+
+	// a snapshot of a large tree costs nothing, writes after it a path copy each
+	tree = bpt_create(64, 0);
+	for(int i = 0; i < 1000000; i++)
+		bpt_put(tree, &i, (void*)(intptr_t)(i + 1));
+	b = clock();
+	snapshot = bpt_snapshot(tree);
+	e = clock();
+	printf("[SNAPSHOT 1M keys] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	b = clock();
+	for(int i = 0; i < 100000; i++) {
+		int k = rand() % 1000000;
+		*bpt_get_ref(tree, &k) = NULL;
+	}
+	e = clock();
+	printf("[UPDATE 100K after snapshot] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	for(int i = 0; i < 1000000; i += 997)
+		assert(bpt_get(snapshot, &i) == (void*)(intptr_t)(i + 1));
+	bpt_destroy(snapshot);
+	bpt_destroy(tree);
+
+	// bulk loading at several orders, sizes and fill factors
+	int* sorted_keys = malloc(1000000 * sizeof(int));
+	void** sorted_values = malloc(1000000 * sizeof(void*));
+	for(int i = 0; i < 1000000; ++i) {
+		sorted_keys[i] = i * 2;
+		sorted_values[i] = (void*)(intptr_t)(i + 1);
+	}
+	double fill_factors[] = {0.1, 0.5, 0.7, 1.0};
+	for(int order = 3; order <= 9; ++order) {
+		for(int count = 0; count <= 200; ++count) {
+			for(int f = 0; f < 4; ++f) {
+				tree = bpt_create(order, f == 1 ? BPT_RECORDS : 0);
+				assert(bpt_load_sorted(tree, sorted_keys, sorted_values, count, fill_factors[f]));
+				check_tree(tree);
+				for(int i = 0; i < count; ++i)
+					assert(bpt_get(tree, &sorted_keys[i]) == sorted_values[i]);
+				for(int i = 0; i < count; i += 3) {
+					int odd = sorted_keys[i] + 1;
+					assert(bpt_put(tree, &odd, NULL));
+					assert(bpt_remove(tree, &sorted_keys[i]));
+				}
+				check_tree(tree);
+				bpt_destroy(tree);
+			}
+		}
+	}
+	tree = bpt_create(16, 0);
+	assert(bpt_put(tree, &sorted_keys[0], NULL));
+	assert(!bpt_load_sorted(tree, sorted_keys, sorted_values, 10, 1.0));
+	bpt_destroy(tree);
+	tree = bpt_create(16, 0);
+	assert(!bpt_load_sorted(tree, (int[]){1, 3, 2}, sorted_values, 3, 1.0));
+	assert(!bpt_load_sorted(tree, (int[]){1, 1}, sorted_values, 2, 1.0));
+	b = clock();
+	assert(bpt_load_sorted(tree, sorted_keys, sorted_values, 1000000, 1.0));
+	e = clock();
+	printf("[BULK LOAD] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	check_tree(tree);
+	bpt_destroy(tree);
+	free(sorted_keys);
+	free(sorted_values);
+
+	// node search kernels against the scalar loops
+	int32_t node_keys[64 + 8];
+	int64_t node_keys64[64 + 4];
+	uint64_t node_keysu64[64 + 4];
+	for(int i = 0; i < 63; ++i) {
+		node_keys[i] = i * 4;
+		node_keys64[i] = (int64_t)(i - 32) * 4;
+		node_keysu64[i] = (uint64_t)i * 4 + (i < 32 ? 0 : UINT64_MAX / 2);
+	}
+	for(int n = 0; n <= 63; ++n) {
+		for(int key = -1; key <= 64 * 4; ++key) {
+			assert(rank_lt_int32(node_keys, n, key) == rank_lt_int32_scalar(node_keys, n, key));
+			assert(rank_le_int32(node_keys, n, key) == rank_le_int32_scalar(node_keys, n, key));
+			int64_t key64 = key - 32 * 4;
+			assert(rank_lt_int64(node_keys64, n, key64) == rank_lt_int64_scalar(node_keys64, n, key64));
+			assert(rank_le_int64(node_keys64, n, key64) == rank_le_int64_scalar(node_keys64, n, key64));
+			uint64_t keyu64 = key + (key % 2 ? 0 : UINT64_MAX / 2);
+			assert(rank_lt_uint64(node_keysu64, n, keyu64) == rank_lt_uint64_scalar(node_keysu64, n, keyu64));
+			assert(rank_le_uint64(node_keysu64, n, keyu64) == rank_le_uint64_scalar(node_keysu64, n, keyu64));
+		}
+	}
+
+	int probes[4096];
+	srand(1);
+	for(int i = 0; i < 4096; ++i)
+		probes[i] = rand() % 256;
+
+	volatile int rank_sink = 0;
+	b = clock();
+	for(int i = 0; i < 20000000; ++i)
+		rank_sink += rank_le_int32_scalar(node_keys, 63, probes[i & 4095]);
+	e = clock();
+	printf("[NODE SEARCH scalar] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	b = clock();
+	for(int i = 0; i < 20000000; ++i)
+		rank_sink += rank_le_int32(node_keys, 63, probes[i & 4095]);
+	e = clock();
+	printf("[NODE SEARCH %d bytes] elapsed time: %lf\n", BPT_SEARCH_WIDTH, (e - b) / (double)CLOCKS_PER_SEC);
+
+	// every key type through inserts, removals, bulk loading and cursors
+	enum bpt_key_type key_types[] = {BPT_KEY_INT32, BPT_KEY_INT64, BPT_KEY_UINT64, BPT_KEY_BINARY, BPT_KEY_COMPARE};
+	size_t key_sizes[] = {4, 8, 8, 20, 12};
+	assert(bpt_create_keyed(16, 0, BPT_KEY_BINARY, 0, NULL) == NULL);
+	assert(bpt_create_keyed(16, 0, BPT_KEY_COMPARE, 12, NULL) == NULL);
+	for(int t = 0; t < 5; ++t) {
+		static bool present[2000];
+		static char packed[2000 * 20];
+		size_t key_size = key_sizes[t];
+		char key[20], key_end[20];
+		for(int order = 3; order <= 33; order += 5) {
+			tree = bpt_create_keyed(order, order == 8 ? BPT_RECORDS : 0, key_types[t], key_size, compare_tagged);
+			assert(tree->key_size == key_size);
+			memset(present, 0, sizeof(present));
+			srand(order * 5 + t);
+			for(int i = 0; i < 6000; ++i) {
+				int k = rand() % 2000;
+				encode_key(key_types[t], k, key);
+				if(rand() % 3)
+					present[k] |= bpt_put(tree, key, (void*)(intptr_t)(k + 1));
+				else if(bpt_remove(tree, key))
+					present[k] = false;
+			}
+			check_tree(tree);
+
+			struct bpt_cursor cursor;
+			int expected = -1;
+			for(bool found = bpt_cursor_seek(tree, &cursor, NULL); found; found = bpt_cursor_next(&cursor)) {
+				for(++expected; !present[expected]; ++expected);
+				encode_key(key_types[t], expected, key);
+				assert(memcmp(bpt_cursor_key(&cursor), key, key_size) == 0);
+				assert(bpt_cursor_value(&cursor) == (void*)(intptr_t)(expected + 1));
+			}
+			for(++expected; expected < 2000; ++expected)
+				assert(!present[expected]);
+
+			for(int k = 0; k < 2000; k += 7) {
+				encode_key(key_types[t], k, key);
+				assert(bpt_get(tree, key) == (present[k] ? (void*)(intptr_t)(k + 1) : NULL));
+				int prev = k;
+				while(prev >= 0 && !present[prev])
+					prev--;
+				bool found = bpt_cursor_seek_last(tree, &cursor, key);
+				assert(found == (prev >= 0));
+				assert(!found || bpt_cursor_value(&cursor) == (void*)(intptr_t)(prev + 1));
+			}
+
+			// batches in key order and shuffled, hits and misses alike
+			void** batch_values = malloc(2000 * sizeof(void*));
+			size_t num_present = 0;
+			for(int k = 0; k < 2000; ++k) {
+				encode_key(key_types[t], k, packed + k * key_size);
+				num_present += present[k];
+			}
+			assert(bpt_get_batch(tree, packed, 2000, batch_values) == num_present);
+			for(int k = 0; k < 2000; ++k)
+				assert(batch_values[k] == (present[k] ? (void*)(intptr_t)(k + 1) : NULL));
+			static int order_of[2000];
+			for(int k = 0; k < 2000; ++k)
+				order_of[k] = k;
+			for(int k = 1999; k > 0; --k) {
+				int r = rand() % (k + 1), tmp = order_of[k];
+				order_of[k] = order_of[r], order_of[r] = tmp;
+			}
+			for(int k = 0; k < 2000; ++k)
+				encode_key(key_types[t], order_of[k], packed + k * key_size);
+			assert(bpt_get_batch(tree, packed, 77, batch_values) <= 77);
+			for(int k = 0; k < 77; ++k)
+				assert(batch_values[k] == (present[order_of[k]] ? (void*)(intptr_t)(order_of[k] + 1) : NULL));
+			free(batch_values);
+
+			int count = 0;
+			for(int k = 500; k <= 1500; ++k)
+				count += present[k];
+			void** range = malloc(1001 * sizeof(void*));
+			encode_key(key_types[t], 500, key);
+			encode_key(key_types[t], 1500, key_end);
+			assert(bpt_get_ranged(tree, key, key_end, range, 1001) == count);
+			free(range);
+			bpt_destroy(tree);
+
+			void** packed_values = malloc(2000 * sizeof(void*));
+			for(int k = 0; k < 2000; ++k) {
+				encode_key(key_types[t], k, packed + k * key_size);
+				packed_values[k] = (void*)(intptr_t)(k + 1);
+			}
+			tree = bpt_create_keyed(order, 0, key_types[t], key_size, compare_tagged);
+			assert(bpt_load_sorted(tree, packed, packed_values, 2000, 0.7));
+			check_tree(tree);
+			for(int k = 0; k < 2000; k += 2) {
+				encode_key(key_types[t], k, key);
+				assert(bpt_remove(tree, key));
+			}
+			check_tree(tree);
+			for(int k = 1; k < 2000; k += 2) {
+				encode_key(key_types[t], k, key);
+				assert(bpt_get(tree, key) == (void*)(intptr_t)(k + 1));
+			}
+
+			// the same tree saved to a page file and mapped back
+			char path[] = "/tmp/bpt_testXXXXXX";
+			close(mkstemp(path));
+			assert(bpt_save(tree, path));
+			struct bpt* mapped = bpt_open(path, compare_tagged);
+			assert(mapped != NULL && bpt_size(mapped) == 1000);
+			for(int k = 0; k < 2000; ++k) {
+				encode_key(key_types[t], k, key);
+				assert(bpt_get(mapped, key) == bpt_get(tree, key));
+			}
+			assert(bpt_get_batch(mapped, packed, 2000, packed_values) == 1000);
+			for(int k = 0; k < 2000; ++k)
+				assert(packed_values[k] == (k % 2 ? (void*)(intptr_t)(k + 1) : NULL));
+
+			struct bpt_cursor mapped_cursor;
+			bool found = bpt_cursor_seek(tree, &cursor, NULL);
+			assert(bpt_cursor_seek(mapped, &mapped_cursor, NULL) == found);
+			while(found) {
+				assert(memcmp(bpt_cursor_key(&mapped_cursor), bpt_cursor_key(&cursor), key_size) == 0);
+				assert(bpt_cursor_value(&mapped_cursor) == bpt_cursor_value(&cursor));
+				found = bpt_cursor_next(&cursor);
+				assert(bpt_cursor_next(&mapped_cursor) == found);
+			}
+			for(int k = 0; k < 2000; k += 3) {
+				encode_key(key_types[t], k, key);
+				found = bpt_cursor_seek_last(tree, &cursor, key);
+				assert(bpt_cursor_seek_last(mapped, &mapped_cursor, key) == found);
+				while(found) {
+					assert(bpt_cursor_value(&mapped_cursor) == bpt_cursor_value(&cursor));
+					found = bpt_cursor_prev(&cursor);
+					assert(bpt_cursor_prev(&mapped_cursor) == found);
+				}
+				found = bpt_cursor_seek(tree, &cursor, key);
+				assert(bpt_cursor_seek(mapped, &mapped_cursor, key) == found);
+				assert(!found || bpt_cursor_value(&mapped_cursor) == bpt_cursor_value(&cursor));
+			}
+			encode_key(key_types[t], 500, key);
+			encode_key(key_types[t], 1500, key_end);
+			assert(bpt_get_ranged(mapped, key, key_end, packed_values, 2000) == 500);
+
+			encode_key(key_types[t], 0, key);
+			assert(!bpt_put(mapped, key, NULL) && !bpt_remove(mapped, key));
+			encode_key(key_types[t], 1, key);
+			assert(bpt_get_ref(mapped, key) == NULL);
+			assert(!bpt_load_sorted(mapped, packed, packed_values, 0, 1.0));
+
+			// a mapped tree saves as a copy of its file
+			char copy_path[] = "/tmp/bpt_testXXXXXX";
+			close(mkstemp(copy_path));
+			assert(bpt_save(mapped, copy_path));
+			bpt_destroy(mapped);
+			mapped = bpt_open(copy_path, compare_tagged);
+			assert(mapped != NULL && bpt_get(mapped, key) == (void*)(intptr_t)2);
+			bpt_destroy(mapped);
+			unlink(copy_path);
+			unlink(path);
+			free(packed_values);
+			bpt_destroy(tree);
+		}
+	}
+
+	// string keys with long shared prefixes and tying key heads
+	{
+		int num_urls = 20000;
+		char key[URL_KEY_SIZE], key_end[URL_KEY_SIZE];
+		int* shuffled = malloc(num_urls * sizeof(int));
+		for(int i = 0; i < num_urls; i++)
+			shuffled[i] = i;
+		for(int i = num_urls - 1; i > 0; i--) {
+			int j = rand() % (i + 1), t = shuffled[i];
+			shuffled[i] = shuffled[j], shuffled[j] = t;
+		}
+		for(int order = 3; order <= 48; order += 15) {
+			struct bpt* tree = bpt_create_keyed(order, 0, BPT_KEY_BINARY, URL_KEY_SIZE, NULL);
+			for(int i = 0; i < num_urls; i++) {
+				encode_url(shuffled[i], key);
+				assert(bpt_put(tree, key, (void*)(intptr_t)(shuffled[i] + 1)));
+			}
+			check_tree(tree);
+			for(int i = 0; i < num_urls; i++) {
+				encode_url(i, key);
+				assert(bpt_get(tree, key) == (void*)(intptr_t)(i + 1));
+				key[URL_KEY_SIZE - 1] = 1;
+				assert(bpt_get(tree, key) == NULL);
+			}
+			// copies of shared nodes take their own out of line keys
+			struct bpt* snapshot = bpt_snapshot(tree);
+			for(int i = 0; i < num_urls; i += 2) {
+				encode_url(shuffled[i], key);
+				assert(bpt_remove(tree, key));
+			}
+			check_tree(tree);
+			char key_start[URL_KEY_SIZE];
+			encode_url(3000, key_start);
+			encode_url(9002, key_end);
+			bpt_remove_range(tree, key_start, key_end);
+			check_tree(tree);
+			for(int i = 1; i < num_urls; i += 2) {
+				encode_url(shuffled[i], key);
+				bool removed = memcmp(key, key_start, URL_KEY_SIZE) >= 0
+					&& memcmp(key, key_end, URL_KEY_SIZE) <= 0;
+				assert((bpt_get(tree, key) != NULL) == !removed);
+			}
+			bpt_destroy(tree);
+			check_tree(snapshot);
+			for(int i = 0; i < num_urls; i++) {
+				encode_url(i, key);
+				assert(bpt_get(snapshot, key) == (void*)(intptr_t)(i + 1));
+			}
+			bpt_destroy(snapshot);
+		}
+		free(shuffled);
+
+		// keys stay out of the node blocks, an order 128 block is smaller than the inline keys and pointers of order 32
+		num_urls = 1000000;
+		int* lookups = malloc(num_urls * sizeof(int));
+		char* urls = malloc((size_t)num_urls * URL_KEY_SIZE);
+		for(int i = 0; i < num_urls; i++) {
+			lookups[i] = rand() % num_urls;
+			encode_url(lookups[i], urls + (size_t)i * URL_KEY_SIZE);
+		}
+		for(int order = 32; order <= 128; order *= 4) {
+			struct bpt* tree = bpt_create_keyed(order, 0, BPT_KEY_BINARY, URL_KEY_SIZE, NULL);
+			assert(tree->node_size < 31 * URL_KEY_SIZE + 32 * sizeof(void*));
+			for(int i = 0; i < num_urls; i++) {
+				encode_url(i, key);
+				bpt_put(tree, key, (void*)(intptr_t)(i + 1));
+			}
+			b = clock();
+			for(int i = 0; i < num_urls; i++)
+				assert(bpt_get(tree, urls + (size_t)i * URL_KEY_SIZE) == (void*)(intptr_t)(lookups[i] + 1));
+			e = clock();
+			printf("[FIND 1M url keys order %d, %zu byte nodes] elapsed time: %lf\n", order, tree->node_size,
+					(e - b) / (double)CLOCKS_PER_SEC);
+			bpt_destroy(tree);
+		}
+		free(urls);
+		free(lookups);
+	}
+
+	// batched point lookups on a tree larger than the cache
+	int num_keys = 8000000;
+	int* big_keys = malloc(num_keys * sizeof(int));
+	void** big_values = malloc(num_keys * sizeof(void*));
+	for(int i = 0; i < num_keys; ++i) {
+		big_keys[i] = i;
+		big_values[i] = (void*)(intptr_t)(i + 1);
+	}
+	tree = bpt_create(64, 0);
+	assert(bpt_load_sorted(tree, big_keys, big_values, num_keys, 1.0));
+	srand(2);
+	for(int i = 0; i < num_keys; ++i)
+		big_keys[i] = rand() % num_keys;
+	b = clock();
+	for(int i = 0; i < num_keys; ++i)
+		big_values[i] = bpt_get(tree, &big_keys[i]);
+	e = clock();
+	printf("[RANDOM FIND 8M keys] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	b = clock();
+	for(int i = 0; i < num_keys; i += 128)
+		assert(bpt_get_batch(tree, &big_keys[i], 128, &big_values[i]) == 128);
+	e = clock();
+	printf("[BATCH FIND 8M keys] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	for(int i = 0; i < num_keys; ++i)
+		assert(big_values[i] == (void*)(intptr_t)(big_keys[i] + 1));
+	for(int i = 0; i < num_keys; i += 128) {
+		int* batch = &big_keys[i];
+		for(int j = 1; j < 128; ++j)
+			for(int k = j; k > 0 && batch[k - 1] > batch[k]; --k) {
+				int tmp = batch[k];
+				batch[k] = batch[k - 1], batch[k - 1] = tmp;
+			}
+	}
+	b = clock();
+	for(int i = 0; i < num_keys; i += 128)
+		assert(bpt_get_batch(tree, &big_keys[i], 128, &big_values[i]) == 128);
+	e = clock();
+	printf("[SORTED BATCH FIND 8M keys] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+
+	// the same tree saved and mapped back, usable as soon as it is opened
+	char path[] = "/tmp/bpt_testXXXXXX";
+	close(mkstemp(path));
+	b = clock();
+	assert(bpt_save(tree, path));
+	e = clock();
+	printf("[SAVE 8M keys] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	bpt_destroy(tree);
+	b = clock();
+	tree = bpt_open(path, NULL);
+	e = clock();
+	assert(tree != NULL && bpt_size(tree) == num_keys);
+	printf("[OPEN 8M keys] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	b = clock();
+	for(int i = 0; i < num_keys; ++i)
+		assert(bpt_get(tree, &big_keys[i]) == (void*)(intptr_t)(big_keys[i] + 1));
+	e = clock();
+	printf("[MAPPED FIND 8M keys] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	bpt_destroy(tree);
+	unlink(path);
+	free(big_keys);
+	free(big_values);
+
+	// empty trees, record trees and files that are not bplus tree files
+	tree = bpt_create(5, BPT_RECORDS);
+	assert(bpt_save(tree, path));
+	bpt_destroy(tree);
+	tree = bpt_open(path, NULL);
+	struct bpt_cursor cursor;
+	assert(tree != NULL && bpt_size(tree) == 0 && bpt_get(tree, &probe) == NULL);
+	assert(!bpt_cursor_seek(tree, &cursor, NULL) && !bpt_cursor_seek_last(tree, &cursor, &probe));
+	bpt_destroy(tree);
+	tree = bpt_create(5, BPT_RECORDS);
+	for(int i = 0; i < 100; ++i)
+		bpt_put(tree, &i, (void*)(intptr_t)(i + 1));
+	assert(bpt_save(tree, path));
+	bpt_destroy(tree);
+	tree = bpt_open(path, NULL);
+	for(int i = 0; i < 100; ++i)
+		assert(bpt_get(tree, &i) == (void*)(intptr_t)(i + 1));
+	bpt_destroy(tree);
+	FILE* file = fopen(path, "r+b");
+	fputc('X', file);
+	fclose(file);
+	assert(bpt_open(path, NULL) == NULL);
+	unlink(path);
+	assert(bpt_open(path, NULL) == NULL);
+	tree = bpt_create_keyed(5, 0, BPT_KEY_COMPARE, 12, compare_tagged);
+	assert(bpt_save(tree, path));
+	bpt_destroy(tree);
+	assert(bpt_open(path, NULL) == NULL);
+	unlink(path);
+
+	// durable trees: group commit, recovery of torn logs and checkpoints
+	{
+		enum { LOGGED_KEYS = 3000 };
+		static int committed[LOGGED_KEYS], live[LOGGED_KEYS];
+		static int loaded_keys[LOGGED_KEYS / 2];
+		static void* loaded_values[LOGGED_KEYS / 2];
+		char wal_path[sizeof(path) + 4];
+		snprintf(wal_path, sizeof(wal_path), "%s.wal", path);
+
+		tree = bpt_open_logged(path, 6, BPT_KEY_INT32, 0, NULL, 0);
+		assert(tree != NULL && bpt_size(tree) == 0);
+		memset(live, 0, sizeof(live));
+		for(int i = 0; i < LOGGED_KEYS / 2; i++) {
+			loaded_keys[i] = i * 2, loaded_values[i] = (void*)(intptr_t)(i + 1);
+			live[i * 2] = i + 1;
+		}
+		assert(bpt_load_sorted(tree, loaded_keys, loaded_values, LOGGED_KEYS / 2, 1.0));
+		assert(bpt_get_ref(tree, &loaded_keys[0]) == NULL);
+		memset(committed, 0, sizeof(committed));
+
+		for(int round = 0; round < 6; round++) {
+			for(int n = 0; n < 2000; n++) {
+				int k = rand() % LOGGED_KEYS, v = rand() + 1;
+				switch(rand() % 4) {
+				case 0:
+				case 1:
+					assert(bpt_put(tree, &k, (void*)(intptr_t)v) == (live[k] == 0));
+					if(live[k] == 0)
+						live[k] = v;
+					break;
+				case 2:
+					assert(bpt_remove(tree, &k) == (live[k] != 0));
+					live[k] = 0;
+					break;
+				default: {
+					int hi = k + rand() % 10;
+					bpt_remove_range(tree, &k, &hi);
+					for(; k <= hi && k < LOGGED_KEYS; k++)
+						live[k] = 0;
+				}
+				}
+			}
+
+			// nothing reaches the log before the commit, everything after it
+			struct bpt* recovered = bpt_open_logged(path, 6, BPT_KEY_INT32, 0, NULL, 0);
+			check_contents(recovered, committed, LOGGED_KEYS);
+			bpt_destroy(recovered);
+			assert(bpt_commit(tree));
+			memcpy(committed, live, sizeof(live));
+			recovered = bpt_open_logged(path, 3 + round, BPT_KEY_INT32, 0, NULL, 0);
+			check_contents(recovered, committed, LOGGED_KEYS);
+			bpt_destroy(recovered);
+
+			if(round == 1) {
+				// a torn record or garbage after the last commit is cut off
+				struct stat st;
+				stat(wal_path, &st);
+				FILE* wal = fopen(wal_path, "ab");
+				for(int i = 0; i < 40; i++)
+					fputc(rand(), wal);
+				fclose(wal);
+				recovered = bpt_open_logged(path, 6, BPT_KEY_INT32, 0, NULL, 0);
+				check_contents(recovered, committed, LOGGED_KEYS);
+				bpt_destroy(recovered);
+				struct stat cut;
+				stat(wal_path, &cut);
+				assert(cut.st_size == st.st_size);
+			} else if(round == 3) {
+				// a crash after the new page file replaced the old one but before the log was emptied
+				FILE* wal = fopen(wal_path, "rb");
+				fseek(wal, 0, SEEK_END);
+				long wal_size = ftell(wal);
+				char* wal_bytes = malloc(wal_size);
+				fseek(wal, 0, SEEK_SET);
+				assert(fread(wal_bytes, 1, wal_size, wal) == (size_t)wal_size);
+				fclose(wal);
+				assert(bpt_checkpoint(tree));
+				struct bpt* checkpointed = bpt_open_logged(path, 6, BPT_KEY_INT32, 0, NULL, 0);
+				check_contents(checkpointed, committed, LOGGED_KEYS);
+				bpt_destroy(checkpointed);
+				wal = fopen(wal_path, "wb");
+				fwrite(wal_bytes, 1, wal_size, wal);
+				fclose(wal);
+				free(wal_bytes);
+				recovered = bpt_open_logged(path, 6, BPT_KEY_INT32, 0, NULL, 0);
+				check_contents(recovered, committed, LOGGED_KEYS);
+				bpt_destroy(recovered);
+				assert(bpt_checkpoint(tree));
+			}
+		}
+
+		// a commit failing halfway through its write leaves nothing behind for the retry to append to
+		struct stat before, after;
+		struct rlimit limit, saved;
+		stat(wal_path, &before);
+		for(int n = 0; n < 200; n++) {
+			int k = rand() % LOGGED_KEYS;
+			if(live[k] == 0 && bpt_put(tree, &k, (void*)(intptr_t)(n + 1)))
+				live[k] = n + 1;
+		}
+		signal(SIGXFSZ, SIG_IGN);
+		getrlimit(RLIMIT_FSIZE, &saved);
+		limit = saved;
+		limit.rlim_cur = before.st_size + 100;
+		setrlimit(RLIMIT_FSIZE, &limit);
+		assert(!bpt_commit(tree));
+		setrlimit(RLIMIT_FSIZE, &saved);
+		stat(wal_path, &after);
+		assert(after.st_size == before.st_size);
+		assert(bpt_commit(tree));
+		struct bpt* retried = bpt_open_logged(path, 6, BPT_KEY_INT32, 0, NULL, 0);
+		check_contents(retried, live, LOGGED_KEYS);
+		bpt_destroy(retried);
+
+		// snapshots do not log, destroying a tree commits
+		struct bpt* snapshot = bpt_snapshot(tree);
+		assert(snapshot->log == NULL);
+		bpt_destroy(snapshot);
+		int k = LOGGED_KEYS - 1;
+		bpt_remove(tree, &k);
+		live[k] = 0;
+		bpt_destroy(tree);
+		tree = bpt_open_logged(path, 6, BPT_KEY_INT32, 0, NULL, 0);
+		check_contents(tree, live, LOGGED_KEYS);
+		bpt_destroy(tree);
+
+		// keys must match those of the page file and of the log, and the page file must be one
+		assert(bpt_open_logged(path, 6, BPT_KEY_INT64, 0, NULL, 0) == NULL);
+		unlink(path);
+		assert(bpt_open_logged(path, 6, BPT_KEY_INT64, 0, NULL, 0) == NULL);
+		unlink(wal_path);
+		FILE* junk = fopen(path, "wb");
+		fputs("not a bplus tree", junk);
+		fclose(junk);
+		assert(bpt_open_logged(path, 6, BPT_KEY_INT32, 0, NULL, 0) == NULL);
+		unlink(path);
+		unlink(wal_path);
+
+		// mutations report on the tree only, the commit after them on the log
+		tree = bpt_open_logged(path, 6, BPT_KEY_INT32, 0, NULL, 1);
+		int first = 1, second = 2, third = 3;
+		stat(wal_path, &before);
+		limit.rlim_cur = before.st_size;
+		setrlimit(RLIMIT_FSIZE, &limit);
+		assert(bpt_put(tree, &first, (void*)(intptr_t)10) && bpt_put(tree, &second, (void*)(intptr_t)20));
+		assert(bpt_remove_range(tree, &second, &third) == 1);
+		assert(!bpt_commit(tree));
+		stat(wal_path, &after);
+		assert(after.st_size == before.st_size);
+		setrlimit(RLIMIT_FSIZE, &saved);
+		assert(!bpt_put(tree, &first, (void*)(intptr_t)11));
+		assert(bpt_put(tree, &third, (void*)(intptr_t)30) && bpt_commit(tree));
+		bpt_destroy(tree);
+		tree = bpt_open_logged(path, 6, BPT_KEY_INT32, 0, NULL, 1);
+		assert(bpt_size(tree) == 2 && bpt_get(tree, &first) == (void*)(intptr_t)10);
+		assert(bpt_get(tree, &second) == NULL && bpt_get(tree, &third) == (void*)(intptr_t)30);
+		bpt_destroy(tree);
+		unlink(wal_path);
+
+		// a change that could not be logged keeps every later commit from claiming durability
+		tree = bpt_open_logged(path, 6, BPT_KEY_INT32, 0, NULL, 0);
+		assert(bpt_put(tree, &first, (void*)(intptr_t)10) && bpt_commit(tree));
+		tree->log->lost = true;
+		assert(bpt_put(tree, &second, (void*)(intptr_t)20));
+		assert(!bpt_commit(tree) && !bpt_checkpoint(tree));
+		bpt_destroy(tree);
+		tree = bpt_open_logged(path, 6, BPT_KEY_INT32, 0, NULL, 0);
+		assert(bpt_size(tree) == 1 && bpt_get(tree, &first) == (void*)(intptr_t)10);
+		bpt_destroy(tree);
+		unlink(wal_path);
+
+		// one fsync per put against one per group of puts
+		tree = bpt_open_logged(path, 64, BPT_KEY_INT32, 0, NULL, 1);
+		double start = wall_time();
+		for(int i = 0; i < 1000; i++)
+			bpt_put(tree, &i, (void*)(intptr_t)(i + 1));
+		printf("[LOGGED PUT 1K, fsync each] elapsed time: %lf\n", wall_time() - start);
+		bpt_destroy(tree);
+		unlink(wal_path);
+		tree = bpt_open_logged(path, 64, BPT_KEY_INT32, 0, NULL, 1000);
+		start = wall_time();
+		for(int i = 0; i < 100000; i++)
+			bpt_put(tree, &i, (void*)(intptr_t)(i + 1));
+		assert(bpt_commit(tree));
+		printf("[LOGGED PUT 100K, fsync per 1000] elapsed time: %lf\n", wall_time() - start);
+		bpt_destroy(tree);
+		unlink(wal_path);
+	}
+
+	// random point lookups on a wide tree
+	tree = bpt_create(64, 0);
+	for(int i = 0; i < 1000000; ++i)
+		bpt_put(tree, &i, (void*)(intptr_t)(i + 1));
+	srand(1);
+	b = clock();
+	for(int i = 0; i < 1000000; ++i) {
+		int key = rand() % 1000000;
+		assert(bpt_get(tree, &key) == (void*)(intptr_t)(key + 1));
+	}
+	e = clock();
+	printf("[RANDOM FIND order 64] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	bpt_destroy(tree);
+	puts("bpt tests passed");
+	return EXIT_SUCCESS;
+}
+#endif
@@ -7,25 +7,117 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+/**
+ * alignment of bplus tree node blocks, one cache line
+ */
+#define BPT_NODE_ALIGN 64
+
+/**
+ * bplus tree creation flags
+ */
+enum bpt_flags {
+	BPT_RECORDS = 1 << 0,	///< keep each value in its own heap record so bpt_get_ref() stays valid across mutations
+};
+
+/**
+ * bplus tree key types
+ */
+enum bpt_key_type {
+	BPT_KEY_INT32,		///< int32_t, the default
+	BPT_KEY_INT64,		///< int64_t
+	BPT_KEY_UINT64,		///< uint64_t
+	BPT_KEY_BINARY,		///< fixed size byte string ordered by memcmp, such as a zero padded string
+	BPT_KEY_COMPARE,	///< fixed size key ordered by a user comparator
+};
+
+/**
+ * key comparator for BPT_KEY_COMPARE
+ *
+ * @return negative, zero or positive as lhs is less than, equal to or greater than rhs
+ */
+typedef int (*bpt_compare)(void* lhs, void* rhs);
+
 /**
  * bplus tree node
+ *
+ * A node is a single BPT_NODE_ALIGN aligned block sized by the tree order:
+ * this header is followed by order - 1 keys of the tree's key size and then
+ * order pointers. keys and pointers point into the same block.
+ *
+ * With BPT_KEY_BINARY the block holds order - 1 64-bit key heads, the 8
+ * bytes of each key following the prefix_len bytes all keys of the node
+ * share, and that prefix once in place of the keys. keys then points to a
+ * separate allocation of the full keys. Searches rank the heads and compare
+ * full keys only on ties, so the block a descent reads stays small however
+ * long the keys are.
+ *
+ * Nodes are shared between a tree and its snapshots. A node referred to more
+ * than once is never modified: a mutation copies it first.
  */
 struct bpt_node {
-	struct bpt_node*	parent;		///< parent node
-	bool				is_leaf;	///< indicates node is leaf or not
-	int*				keys;		///< array of key
+	char*				keys;		///< packed array of key, key_size bytes each
+	void**				pointers;	///< another node, or value (record in BPT_RECORDS mode) on leaf node
 	int					num_keys;	///< number of key
-	void**				pointers;	///< another node, or record on leaf node
+	bool				is_leaf;	///< indicates node is leaf or not
+	uint16_t			prefix_len;	///< bytes of prefix every key shares, BPT_KEY_BINARY only
+	uint32_t			refs;		///< number of trees and nodes referring to the node
 };
 
+/**
+ * bplus tree file page
+ *
+ * bpt_save() writes a tree as a sequence of equally sized pages: page 0 holds
+ * the file header (order, key type, size, root page), every other page one
+ * node. This header is followed by order - 1 keys and then order 64-bit
+ * slots holding child page numbers, or values on leaf pages.
+ */
+struct bpt_page {
+	uint32_t	num_keys;	///< number of key
+	uint32_t	is_leaf;	///< indicates page is leaf or not
+	uint64_t	next;		///< page number of the next leaf, 0 for none
+};
+
+/**
+ * write-ahead log of a durable bplus tree, private to bpt.c
+ */
+struct bpt_log;
+
 /**
  * bplus tree
  */
 struct bpt {
 	struct bpt_node* root;	///< tree root
 	size_t size;			///< number of element
+	int order;				///< maximum number of pointers in a node
+	unsigned flags;			///< bitwise or of enum bpt_flags
+	enum bpt_key_type key_type;	///< key type
+	size_t key_size;		///< bytes per key
+	bpt_compare compare;	///< key comparator, BPT_KEY_COMPARE only
+	size_t node_size;		///< bytes allocated per node
+	void* map;				///< mapped file of a tree opened by bpt_open(), NULL for in-memory trees
+	size_t map_size;		///< bytes mapped
+	size_t page_size;		///< bytes per page of the mapped file
+	uint64_t root_page;		///< root page number of the mapped file, 0 if empty
+	bool frozen;			///< snapshot taken by bpt_snapshot(), read-only
+	bool shared;			///< nodes may be shared with snapshots, so the leaf chain is not followed
+	unsigned* sharers;		///< count of the trees sharing nodes with this one, itself included, NULL unless shared
+	struct bpt_log* log;	///< write-ahead log of a tree opened by bpt_open_logged(), NULL otherwise
+};
+
+/**
+ * bplus tree cursor
+ *
+ * Points at one element inside a leaf so range scans run in constant memory.
+ * Any mutation of the tree invalidates it.
+ */
+struct bpt_cursor {
+	struct bpt*			tree;	///< iterated tree
+	struct bpt_node*	leaf;	///< current leaf, NULL once iteration ran off either end
+	struct bpt_page*	page;	///< current leaf page instead of leaf for a mapped tree
+	int					index;	///< element index inside leaf
 };
 
 #ifdef __cplusplus
@@ -35,17 +127,51 @@ extern "C" {
 /**
  * Create a new bplus tree
  *
- * @return newly created bplus tree
+ * Keys are int32_t. Every key argument of bpt_* functions is a pointer to one.
+ *
+ * Values are stored inline in the leaves unless BPT_RECORDS is given.
+ *
+ * @param order maximum number of pointers in a node, at least 3
+ * @param flags bitwise or of enum bpt_flags
+ *
+ * @return newly created bplus tree, NULL on invalid order or out of memory
  */
-struct bpt* bpt_create();
+struct bpt* bpt_create(int order, unsigned flags);
 
 /**
- * Destroy a bplus tree
+ * Create a new bplus tree with the given key type
+ *
+ * Keys are copied into the nodes, key_size bytes each. Every key argument
+ * of bpt_* functions, and every element of bpt_load_sorted() keys, is
+ * a pointer to such a key.
+ *
+ * @param order maximum number of pointers in a node, at least 3
+ * @param flags bitwise or of enum bpt_flags
+ * @param key_type key type
+ * @param key_size bytes per key, ignored for integer key types
+ * @param compare key comparator for BPT_KEY_COMPARE, ignored otherwise
+ *
+ * @return newly created bplus tree, NULL on invalid arguments or out of memory
+ */
+struct bpt* bpt_create_keyed(int order, unsigned flags, enum bpt_key_type key_type,
+		size_t key_size, bpt_compare compare);
+
+/**
+ * Destroy a bplus tree or snapshot
  *
  * @param self bplus tree
  */
 void bpt_destroy(struct bpt* self);
 
+/**
+ * Get number of elements
+ *
+ * @param self bplus tree
+ *
+ * @return number of elements
+ */
+size_t bpt_size(struct bpt* self);
+
 /**
  * Put key and value into bplus tree
  *
@@ -53,10 +179,151 @@ void bpt_destroy(struct bpt* self);
  * @param key key
  * @param value value
  *
- * @return key and value inserted or not
+ * @return key and value inserted or not. false if key already exists
  */
 bool bpt_put(struct bpt* self, void* key, void* value);
 
+/**
+ * Build bplus tree from sorted elements in O(n)
+ *
+ * Leaves and internal levels are built bottom-up, each node filled to
+ * fill_factor of its capacity (but never below the minimum occupancy).
+ *
+ * @param self empty bplus tree
+ * @param keys packed keys array, key_size bytes each, in strictly increasing order
+ * @param values values array
+ * @param count number of elements
+ * @param fill_factor node occupancy in (0, 1], 1 packs nodes full
+ *
+ * @return elements loaded or not. false if tree is not empty or keys are not sorted
+ */
+bool bpt_load_sorted(struct bpt* self, void* keys, void** values, size_t count, double fill_factor);
+
+/**
+ * Save bplus tree to a page file
+ *
+ * Values are stored as 64-bit integers, so they should be meaningful to
+ * whichever process opens the file: numbers or offsets rather than heap
+ * addresses.
+ *
+ * @param self bplus tree
+ * @param path file to create or overwrite
+ *
+ * @return tree saved or not
+ */
+bool bpt_save(struct bpt* self, const char* path);
+
+/**
+ * Open a page file saved by bpt_save()
+ *
+ * The file is mapped rather than read, so opening takes constant time
+ * whatever the file size and pages are faulted in as lookups touch them.
+ * The returned tree is read-only: bpt_put(), bpt_remove() and
+ * bpt_load_sorted() fail and bpt_get_ref() returns NULL. Everything else
+ * works as on an in-memory tree. bpt_destroy() unmaps the file.
+ *
+ * The file is trusted to be well formed beyond its header.
+ *
+ * @param path file to open
+ * @param compare key comparator if the file holds BPT_KEY_COMPARE keys, ignored otherwise
+ *
+ * @return opened bplus tree, NULL if the file cannot be mapped or is not a bplus tree file
+ */
+struct bpt* bpt_open(const char* path, bpt_compare compare);
+
+/**
+ * Open a durable bplus tree backed by a page file and a write-ahead log
+ *
+ * The tree lives in memory. bpt_put(), bpt_remove(), bpt_remove_range() and
+ * bpt_load_sorted() append their changes to the log, path with ".wal"
+ * appended, instead of rewriting pages. Log records are buffered and
+ * written with a single fsync once group_size of them are pending or
+ * bpt_commit() is called, so many small writes share one fsync. A change is
+ * durable once the commit covering it returned. bpt_checkpoint() folds the
+ * log into the page file.
+ *
+ * The mutations return whether they changed the tree, as for any tree, and
+ * never report on the log. When an automatic commit fails, its records stay
+ * buffered and the next commit retries them, so a change is durable only
+ * once a bpt_commit() returning true covered it. Callers that need to know
+ * call bpt_commit() after the changes they care about. A record that
+ * cannot be buffered, as memory ran out and writing the buffered ones to
+ * make room failed too, leaves a change the log can never hold: from then
+ * on bpt_commit() and bpt_checkpoint() fail and the files keep the last
+ * committed state, which reopening recovers.
+ *
+ * Opening loads the page file, if any, and replays the log on top of it.
+ * A record torn by a crash ends the replay and is cut off the log.
+ *
+ * Values are stored as 64-bit integers, as with bpt_save(). bpt_get_ref()
+ * returns NULL, as writes through it would bypass the log.
+ * bpt_destroy() commits pending records before closing the log.
+ *
+ * @param path page file, created at the first checkpoint if missing
+ * @param order maximum number of pointers in a node, at least 3
+ * @param key_type key type, must match the page file and log if they exist
+ * @param key_size bytes per key, ignored for integer key types
+ * @param compare key comparator for BPT_KEY_COMPARE, ignored otherwise
+ * @param group_size log records per automatic commit, 0 to commit only by bpt_commit()
+ *
+ * @return opened bplus tree, NULL on invalid arguments, unreadable or mismatching files or out of memory
+ */
+struct bpt* bpt_open_logged(const char* path, int order, enum bpt_key_type key_type,
+		size_t key_size, bpt_compare compare, size_t group_size);
+
+/**
+ * Make the pending changes of a durable bplus tree durable
+ *
+ * Writes every buffered log record and waits for a single fsync. Records
+ * of automatic commits that failed are still buffered and written too, so
+ * true means every change made so far is durable.
+ *
+ * @param self bplus tree opened by bpt_open_logged()
+ *
+ * @return changes committed or not. false if the tree has no log or writing failed
+ */
+bool bpt_commit(struct bpt* self);
+
+/**
+ * Fold the write-ahead log of a durable bplus tree into its page file
+ *
+ * Commits, writes the whole tree to a new page file that atomically
+ * replaces the old one and then empties the log. A crash between the two
+ * leaves a log whose replay over the new page file changes nothing.
+ *
+ * @param self bplus tree opened by bpt_open_logged()
+ *
+ * @return checkpoint done or not
+ */
+bool bpt_checkpoint(struct bpt* self);
+
+/**
+ * Take a snapshot of a bplus tree
+ *
+ * The snapshot shares every node with the tree and takes constant time.
+ * Nodes are copied on write afterwards: a mutation of the tree copies the
+ * shared nodes on its root to leaf path, and those of the neighbors it
+ * rebalances with, before modifying them, so the snapshot keeps seeing the
+ * tree as it was. Reference counts free a node once neither the tree nor
+ * any snapshot refers to it.
+ *
+ * The snapshot is read-only like a tree opened by bpt_open() and is
+ * released with bpt_destroy(). While snapshots exist, the tree and its
+ * snapshots step from a leaf to the next by descending from the root, as a
+ * shared leaf cannot link to a successor that differs between versions. The
+ * first mutation of the tree after its last snapshot is destroyed relinks
+ * the leaves, and scans follow the leaf chain again.
+ *
+ * bpt_snapshot() and the mutations of the tree must not run concurrently.
+ * A snapshot may be read and destroyed by another thread while the tree is
+ * being mutated.
+ *
+ * @param self bplus tree
+ *
+ * @return snapshot, NULL for trees created with BPT_RECORDS, mapped trees or out of memory
+ */
+struct bpt* bpt_snapshot(struct bpt* self);
+
 /**
  * Remove element using key
  *
@@ -67,6 +334,21 @@ bool bpt_put(struct bpt* self, void* key, void* value);
  */
 bool bpt_remove(struct bpt* self, void* key);
 
+/**
+ * Remove all elements whose key lies between key_start and key_end inclusive
+ *
+ * The range is stripped out of the leaves in a single pass along the leaf
+ * chain and the tree is rebalanced once afterwards, instead of descending
+ * and rebalancing for every key.
+ *
+ * @param self bplus tree
+ * @param key_start range start
+ * @param key_end range end
+ *
+ * @return number of removed elements
+ */
+size_t bpt_remove_range(struct bpt* self, void* key_start, void* key_end);
+
 /**
  * Get element from bplus tree
  *
@@ -77,6 +359,37 @@ bool bpt_remove(struct bpt* self, void* key);
  */
 void* bpt_get(struct bpt* self, void* key);
 
+/**
+ * Get elements of many keys at once
+ *
+ * Keys are searched in groups that descend the tree together with the
+ * next level prefetched, which hides most cache misses on trees larger
+ * than the cache. Sorted keys additionally share their descent paths.
+ *
+ * @param self bplus tree
+ * @param keys packed keys array, key_size bytes each
+ * @param count number of keys
+ * @param values value holder of count elements, NULL for missing keys
+ *
+ * @return number of keys found
+ */
+size_t bpt_get_batch(struct bpt* self, void* keys, size_t count, void** values);
+
+/**
+ * Get reference to the stored value
+ *
+ * The reference stays valid until the key is removed when the tree
+ * was created with BPT_RECORDS, otherwise only until the next mutation.
+ * On a snapshotted tree the leaf is copied first if a snapshot shares it.
+ * Snapshots, like mapped trees, return NULL.
+ *
+ * @param self bplus tree
+ * @param key key
+ *
+ * @return reference to value or NULL
+ */
+void** bpt_get_ref(struct bpt* self, void* key);
+
 /**
  * Get elements from bplus tree
  *
@@ -86,10 +399,68 @@ void* bpt_get(struct bpt* self, void* key);
  * @param values value holder
  * @param values_size value holder capacity
  *
- * @return number of matched elements
+ * @return number of matched elements, at most values_size
  */
 size_t bpt_get_ranged(struct bpt* self, void* key_start, void* key_end, void** values, size_t values_size);
 
+/**
+ * Position cursor at the first element whose key is not less than key
+ *
+ * @param self bplus tree
+ * @param cursor cursor to position
+ * @param key key, or NULL for the first element
+ *
+ * @return cursor points at an element or not
+ */
+bool bpt_cursor_seek(struct bpt* self, struct bpt_cursor* cursor, void* key);
+
+/**
+ * Position cursor at the last element whose key is not greater than key
+ *
+ * @param self bplus tree
+ * @param cursor cursor to position
+ * @param key key, or NULL for the last element
+ *
+ * @return cursor points at an element or not
+ */
+bool bpt_cursor_seek_last(struct bpt* self, struct bpt_cursor* cursor, void* key);
+
+/**
+ * Move cursor to the next element in key order
+ *
+ * @param self cursor
+ *
+ * @return cursor points at an element or not
+ */
+bool bpt_cursor_next(struct bpt_cursor* self);
+
+/**
+ * Move cursor to the previous element in key order
+ *
+ * @param self cursor
+ *
+ * @return cursor points at an element or not
+ */
+bool bpt_cursor_prev(struct bpt_cursor* self);
+
+/**
+ * Get key of the current element
+ *
+ * @param self cursor
+ *
+ * @return pointer to the key stored in the leaf, or NULL
+ */
+void* bpt_cursor_key(struct bpt_cursor* self);
+
+/**
+ * Get value of the current element
+ *
+ * @param self cursor
+ *
+ * @return value, or NULL
+ */
+void* bpt_cursor_value(struct bpt_cursor* self);
+
 #ifdef __cplusplus
 }
 #endif
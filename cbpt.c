@@ -0,0 +1,516 @@
+/*
+    libtds: tiny data structures
+    Copyright (C) 2017 junhee lee
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cbpt.h"
+
+#define CBPT_LOCKED 1
+
+typedef struct cbpt_node node;
+
+static node* make_node(struct cbpt* self, bool is_leaf);
+static void destroy_tree(node* n);
+static bool split_node(struct cbpt* self, node* parent, node* n);
+
+// VERSION LOCKS.
+
+/* Optimistic lock coupling: a reader notes the version of a node, reads
+ * it without writing anything, and validates the version afterwards.
+ * A writer upgrades the version it read into a lock with a single CAS,
+ * which fails if anybody modified the node in between. Every failure
+ * restarts the operation from the root.
+ */
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static inline bool read_lock(node* n, uint64_t* version) {
+	uint64_t v = __atomic_load_n(&n->version, __ATOMIC_ACQUIRE);
+	if(v & CBPT_LOCKED) {
+		cpu_relax();
+		return false;
+	}
+
+	*version = v;
+	return true;
+}
+
+static inline bool read_validate(node* n, uint64_t version) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&n->version, __ATOMIC_RELAXED) == version;
+}
+
+static inline bool upgrade_lock(node* n, uint64_t version) {
+	if(!__atomic_compare_exchange_n(&n->version, &version, version + CBPT_LOCKED, false,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return false;
+
+	// the lock bit must be visible before any write to the node
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return true;
+}
+
+static inline void write_unlock(node* n) {
+	__atomic_fetch_add(&n->version, CBPT_LOCKED, __ATOMIC_RELEASE);
+}
+
+// NODE SEARCH.
+
+/* Readers may see num_keys halfway through a writer's update, so it is
+ * clamped to stay inside the node; validation discards what was read.
+ */
+static inline int node_num_keys(struct cbpt* self, node* n) {
+	int num_keys = __atomic_load_n(&n->num_keys, __ATOMIC_RELAXED);
+	return num_keys < 0 ? 0 : num_keys > self->order - 1 ? self->order - 1 : num_keys;
+}
+
+/* Number of keys less than key, or not greater than key unless strict. */
+static inline int node_rank(const int32_t* keys, int num_keys, int32_t key, bool strict) {
+	int lo = 0, hi = num_keys;
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(keys[mid] < key || (!strict && keys[mid] == key))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+struct cbpt* cbpt_create(int order) {
+	if(order < 3)
+		return NULL;
+
+	struct cbpt* self = (struct cbpt*)calloc(1, sizeof(struct cbpt));
+	if(!self)
+		return NULL;
+
+	size_t size = sizeof(node) + (order - 1) * sizeof(int32_t);
+	size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+	size += order * sizeof(void*);
+	self->node_size = (size + CBPT_NODE_ALIGN - 1) & ~(size_t)(CBPT_NODE_ALIGN - 1);
+	self->order = order;
+
+	// an empty leaf root spares every operation the empty tree case
+	self->root = make_node(self, true);
+	if(!self->root) {
+		free(self);
+		return NULL;
+	}
+	return self;
+}
+
+void cbpt_destroy(struct cbpt* self) {
+	destroy_tree(self->root);
+	memset(self, 0, sizeof(struct cbpt)), free(self);
+}
+
+size_t cbpt_size(struct cbpt* self) {
+	return __atomic_load_n(&self->size, __ATOMIC_RELAXED);
+}
+
+/* Descends to the leaf holding key with read locks coupled level by level:
+ * a child pointer is only followed after its parent validated, and the
+ * parent is validated again once the child's version is known, so the
+ * child was still the right one when that version was taken.
+ * Returns NULL when the caller has to restart.
+ */
+static node* find_leaf(struct cbpt* self, int32_t key, uint64_t* version) {
+	node* n = __atomic_load_n(&self->root, __ATOMIC_ACQUIRE);
+	uint64_t v;
+	if(!read_lock(n, &v))
+		return NULL;
+
+	while(!n->is_leaf) {
+		int i = node_rank(n->keys, node_num_keys(self, n), key, false);
+		node* child = __atomic_load_n(&n->pointers[i], __ATOMIC_RELAXED);
+		uint64_t child_version;
+		if(!read_validate(n, v) || !read_lock(child, &child_version) || !read_validate(n, v))
+			return NULL;
+
+		n = child;
+		v = child_version;
+	}
+
+	*version = v;
+	return n;
+}
+
+void* cbpt_get(struct cbpt* self, void* key) {
+	int32_t k = *(int32_t*)key;
+	for(;;) {
+		uint64_t version;
+		node* leaf = find_leaf(self, k, &version);
+		if(leaf == NULL)
+			continue;
+
+		int num_keys = node_num_keys(self, leaf);
+		int i = node_rank(leaf->keys, num_keys, k, true);
+		void* value = NULL;
+		if(i < num_keys && leaf->keys[i] == k)
+			value = __atomic_load_n(&leaf->pointers[i], __ATOMIC_RELAXED);
+
+		if(read_validate(leaf, version))
+			return value;
+	}
+}
+
+/* Full nodes are split on the way down, so a node being split always has
+ * a parent with room for the new separator and a split never propagates:
+ * only the node and its parent are locked.
+ */
+bool cbpt_put(struct cbpt* self, void* key, void* value) {
+	int32_t k = *(int32_t*)key;
+
+restart:;
+	node* n = __atomic_load_n(&self->root, __ATOMIC_ACQUIRE);
+	node* parent = NULL;
+	uint64_t version, parent_version = 0;
+	if(!read_lock(n, &version))
+		goto restart;
+
+	for(;;) {
+		if(node_num_keys(self, n) == self->order - 1) {
+			if(parent && !upgrade_lock(parent, parent_version))
+				goto restart;
+			if(!upgrade_lock(n, version)) {
+				if(parent)
+					write_unlock(parent);
+				goto restart;
+			}
+			if(!parent && n != self->root) {
+				write_unlock(n);
+				goto restart;
+			}
+
+			bool split = split_node(self, parent, n);
+			write_unlock(n);
+			if(parent)
+				write_unlock(parent);
+			if(!split)
+				return false;
+			goto restart;
+		}
+
+		if(n->is_leaf)
+			break;
+
+		int i = node_rank(n->keys, node_num_keys(self, n), k, false);
+		node* child = __atomic_load_n(&n->pointers[i], __ATOMIC_RELAXED);
+		uint64_t child_version;
+		if(!read_validate(n, version) || !read_lock(child, &child_version) || !read_validate(n, version))
+			goto restart;
+
+		parent = n;
+		parent_version = version;
+		n = child;
+		version = child_version;
+	}
+
+	if(!upgrade_lock(n, version))
+		goto restart;
+
+	int i = node_rank(n->keys, n->num_keys, k, true);
+	if(i < n->num_keys && n->keys[i] == k) {
+		write_unlock(n);
+		return false;
+	}
+
+	memmove(&n->keys[i + 1], &n->keys[i], (n->num_keys - i) * sizeof(int32_t));
+	memmove(&n->pointers[i + 1], &n->pointers[i], (n->num_keys - i) * sizeof(void*));
+	n->keys[i] = k;
+	n->pointers[i] = value;
+	n->num_keys++;
+	write_unlock(n);
+
+	__atomic_fetch_add(&self->size, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+/* Only the leaf is locked. Underfull nodes are left alone rather than
+ * merged, which keeps every node reachable by a concurrent reader valid.
+ */
+bool cbpt_remove(struct cbpt* self, void* key) {
+	int32_t k = *(int32_t*)key;
+	for(;;) {
+		uint64_t version;
+		node* leaf = find_leaf(self, k, &version);
+		if(leaf == NULL || !upgrade_lock(leaf, version))
+			continue;
+
+		int i = node_rank(leaf->keys, leaf->num_keys, k, true);
+		if(i == leaf->num_keys || leaf->keys[i] != k) {
+			write_unlock(leaf);
+			return false;
+		}
+
+		memmove(&leaf->keys[i], &leaf->keys[i + 1], (leaf->num_keys - i - 1) * sizeof(int32_t));
+		memmove(&leaf->pointers[i], &leaf->pointers[i + 1], (leaf->num_keys - i - 1) * sizeof(void*));
+		leaf->num_keys--;
+		write_unlock(leaf);
+
+		__atomic_fetch_add(&self->size, -1, __ATOMIC_RELAXED);
+		return true;
+	}
+}
+
+/* Creates a new node, which can be adapted to serve as either a leaf or an internal node. */
+static node* make_node(struct cbpt* self, bool is_leaf) {
+	node* n = aligned_alloc(CBPT_NODE_ALIGN, self->node_size);
+	if(n == NULL)
+		return NULL;
+
+	memset(n, 0, self->node_size);
+	n->keys = (int32_t*)((char*)n + sizeof(node));
+	size_t offset = sizeof(node) + (self->order - 1) * sizeof(int32_t);
+	n->pointers = (void**)((char*)n + ((offset + sizeof(void*) - 1) & ~(sizeof(void*) - 1)));
+	n->is_leaf = is_leaf;
+	return n;
+}
+
+static void destroy_tree(node* n) {
+	if(!n->is_leaf)
+		for(int i = 0; i <= n->num_keys; i++)
+			destroy_tree(n->pointers[i]);
+	free(n);
+}
+
+/* Splits the full node n, both n and its parent (if any) write locked.
+ * The new right sibling is filled before the parent links it, so readers
+ * can only reach it complete. Returns false if memory runs out, leaving
+ * the tree untouched.
+ */
+static bool split_node(struct cbpt* self, node* parent, node* n) {
+	node* right = make_node(self, n->is_leaf);
+	node* root = NULL;
+	if(right == NULL)
+		return false;
+	if(parent == NULL && (root = make_node(self, false)) == NULL) {
+		free(right);
+		return false;
+	}
+
+	int32_t separator;
+	if(n->is_leaf) {
+		// leaf keys are all kept, the right half's first key is copied up
+		int split = n->num_keys / 2;
+		right->num_keys = n->num_keys - split;
+		memcpy(right->keys, &n->keys[split], right->num_keys * sizeof(int32_t));
+		memcpy(right->pointers, &n->pointers[split], right->num_keys * sizeof(void*));
+		n->num_keys = split;
+		separator = right->keys[0];
+	} else {
+		// the middle key moves up, its children are shared out on each side
+		int split = n->num_keys / 2;
+		separator = n->keys[split];
+		right->num_keys = n->num_keys - split - 1;
+		memcpy(right->keys, &n->keys[split + 1], right->num_keys * sizeof(int32_t));
+		memcpy(right->pointers, &n->pointers[split + 1], (right->num_keys + 1) * sizeof(void*));
+		n->num_keys = split;
+	}
+
+	if(parent == NULL) {
+		root->keys[0] = separator;
+		root->pointers[0] = n;
+		root->pointers[1] = right;
+		root->num_keys = 1;
+		__atomic_store_n(&self->root, root, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	int i = node_rank(parent->keys, parent->num_keys, separator, false);
+	memmove(&parent->keys[i + 1], &parent->keys[i], (parent->num_keys - i) * sizeof(int32_t));
+	memmove(&parent->pointers[i + 2], &parent->pointers[i + 1], (parent->num_keys - i) * sizeof(void*));
+	parent->keys[i] = separator;
+	parent->pointers[i + 1] = right;
+	parent->num_keys++;
+	return true;
+}
+
+#ifndef NDBUG
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Verifies sorted keys inside the parent's bounds and equal leaf depth.
+ * Returns the number of keys.
+ */
+static size_t check_node(struct cbpt* self, node* n, int64_t lo, int64_t hi, int depth, int* leaf_depth) {
+	assert((n->version & CBPT_LOCKED) == 0);
+	assert(n->num_keys <= self->order - 1);
+	for(int i = 0; i < n->num_keys; i++) {
+		assert(n->keys[i] >= lo && n->keys[i] < hi);
+		assert(i == 0 || n->keys[i - 1] < n->keys[i]);
+	}
+
+	if(n->is_leaf) {
+		if(*leaf_depth < 0)
+			*leaf_depth = depth;
+		assert(*leaf_depth == depth);
+		return n->num_keys;
+	}
+
+	size_t num_keys = 0;
+	for(int i = 0; i <= n->num_keys; i++)
+		num_keys += check_node(self, n->pointers[i], i == 0 ? lo : n->keys[i - 1],
+				i == n->num_keys ? hi : n->keys[i], depth + 1, leaf_depth);
+	return num_keys;
+}
+
+static void check_tree(struct cbpt* self) {
+	int leaf_depth = -1;
+	assert(check_node(self, self->root, INT32_MIN, (int64_t)INT32_MAX + 1, 0, &leaf_depth) == self->size);
+}
+
+#define NUM_THREADS 8
+#define NUM_KEYS 400000
+
+struct worker {
+	pthread_t thread;
+	struct cbpt* tree;
+	int id;
+	int num_threads;
+	size_t num_ops;
+	volatile bool* stop;
+};
+
+/* Scatters i over the key space so stripes of threads interleave. */
+static int32_t scatter(int i) {
+	return (int32_t)((uint32_t)i * 2654435761u >> 1);
+}
+
+static void* insert_worker(void* arg) {
+	struct worker* w = arg;
+	for(int i = w->id; i < NUM_KEYS; i += w->num_threads) {
+		int32_t key = scatter(i);
+		assert(cbpt_put(w->tree, &key, (void*)(intptr_t)(i + 1)));
+	}
+	return NULL;
+}
+
+static void* remove_worker(void* arg) {
+	struct worker* w = arg;
+	for(int i = w->id * 2; i < NUM_KEYS; i += w->num_threads * 2) {
+		int32_t key = scatter(i);
+		assert(cbpt_remove(w->tree, &key));
+	}
+	return NULL;
+}
+
+/* Looks up random keys until told to stop; a key is either absent or maps to its own value. */
+static void* read_worker(void* arg) {
+	struct worker* w = arg;
+	unsigned seed = w->id;
+	while(!*w->stop) {
+		int i = rand_r(&seed) % NUM_KEYS;
+		int32_t key = scatter(i);
+		void* value = cbpt_get(w->tree, &key);
+		assert(value == NULL || value == (void*)(intptr_t)(i + 1));
+		w->num_ops++;
+	}
+	return NULL;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+	struct worker workers[NUM_THREADS * 2];
+	volatile bool stop = false;
+
+	// single threaded semantics
+	for(int order = 3; order <= 64; order += 61) {
+		struct cbpt* tree = cbpt_create(order);
+		assert(cbpt_create(2) == NULL);
+		for(int i = 0; i < 100000; ++i) {
+			int32_t key = scatter(i);
+			assert(cbpt_put(tree, &key, (void*)(intptr_t)(i + 1)));
+			assert(!cbpt_put(tree, &key, NULL));
+		}
+		check_tree(tree);
+		for(int i = 0; i < 100000; i += 2) {
+			int32_t key = scatter(i);
+			assert(cbpt_remove(tree, &key));
+			assert(!cbpt_remove(tree, &key));
+		}
+		assert(cbpt_size(tree) == 50000);
+		check_tree(tree);
+		for(int i = 0; i < 100000; ++i) {
+			int32_t key = scatter(i);
+			assert(cbpt_get(tree, &key) == (i % 2 ? (void*)(intptr_t)(i + 1) : NULL));
+		}
+		cbpt_destroy(tree);
+	}
+
+	// writers on disjoint stripes racing with readers
+	struct cbpt* tree = cbpt_create(16);
+	for(int i = 0; i < NUM_THREADS * 2; ++i) {
+		workers[i] = (struct worker){.tree = tree, .id = i, .num_threads = NUM_THREADS, .stop = &stop};
+		pthread_create(&workers[i].thread, NULL, i < NUM_THREADS ? insert_worker : read_worker, &workers[i]);
+	}
+	for(int i = 0; i < NUM_THREADS; ++i)
+		pthread_join(workers[i].thread, NULL);
+	for(int i = 0; i < NUM_THREADS; ++i)
+		workers[i].id = i, pthread_create(&workers[i].thread, NULL, remove_worker, &workers[i]);
+	for(int i = 0; i < NUM_THREADS; ++i)
+		pthread_join(workers[i].thread, NULL);
+	stop = true;
+	for(int i = NUM_THREADS; i < NUM_THREADS * 2; ++i)
+		pthread_join(workers[i].thread, NULL);
+
+	assert(cbpt_size(tree) == NUM_KEYS / 2);
+	check_tree(tree);
+	for(int i = 0; i < NUM_KEYS; ++i) {
+		int32_t key = scatter(i);
+		assert(cbpt_get(tree, &key) == (i % 2 ? (void*)(intptr_t)(i + 1) : NULL));
+	}
+
+	// read throughput by number of threads
+	for(int i = 0; i < NUM_KEYS; i += 2) {
+		int32_t key = scatter(i);
+		assert(cbpt_put(tree, &key, (void*)(intptr_t)(i + 1)));
+	}
+	for(int num_threads = 1; num_threads <= NUM_THREADS; num_threads *= 2) {
+		stop = false;
+		double b = now();
+		for(int i = 0; i < num_threads; ++i) {
+			workers[i] = (struct worker){.tree = tree, .id = i, .num_threads = num_threads, .stop = &stop};
+			pthread_create(&workers[i].thread, NULL, read_worker, &workers[i]);
+		}
+		struct timespec delay = {0, 200000000};
+		nanosleep(&delay, NULL);
+		stop = true;
+		size_t num_ops = 0;
+		for(int i = 0; i < num_threads; ++i) {
+			pthread_join(workers[i].thread, NULL);
+			num_ops += workers[i].num_ops;
+		}
+		printf("[FIND %d threads] %.2lf Mops/s\n", num_threads, num_ops / (now() - b) / 1e6);
+	}
+	cbpt_destroy(tree);
+	puts("cbpt tests passed");
+	return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,143 @@
+/*
+    libtds: tiny data structures
+    Copyright (C) 2017 junhee lee
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __CBPT_H__
+#define __CBPT_H__
+
+/**
+ * @file
+ * Concurrent B+ Tree implementation using optimistic lock coupling
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * alignment of concurrent bplus tree node blocks, one cache line
+ */
+#define CBPT_NODE_ALIGN 64
+
+/**
+ * concurrent bplus tree node
+ *
+ * A node is a single CBPT_NODE_ALIGN aligned block sized by the tree order:
+ * this header is followed by order - 1 keys and then order pointers.
+ *
+ * version doubles as the node lock. Its lowest bit is set while a writer
+ * holds the node and every unlock advances it, so a reader that saw the
+ * same unlocked version before and after reading a node knows its reads
+ * were consistent.
+ */
+struct cbpt_node {
+	uint64_t	version;	///< lock bit and modification counter
+	int			num_keys;	///< number of key
+	bool		is_leaf;	///< indicates node is leaf or not
+	int32_t*	keys;		///< array of key
+	void**		pointers;	///< another node, or value on leaf node
+};
+
+/**
+ * concurrent bplus tree
+ */
+struct cbpt {
+	struct cbpt_node* root;	///< tree root, never NULL
+	size_t size;			///< number of element
+	int order;				///< maximum number of pointers in a node
+	size_t node_size;		///< bytes allocated per node
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Create a new concurrent bplus tree
+ *
+ * Keys are int32_t. Every key argument of cbpt_* functions is a pointer to one.
+ * Values are stored inline in the leaves.
+ *
+ * All functions but cbpt_destroy() may be called from any number of
+ * threads at once. Readers never write shared memory: they validate node
+ * versions and retry when a writer got in the way. Writers lock only the
+ * leaf they modify, plus the nodes they split.
+ *
+ * Removal never merges nodes, so memory of emptied nodes is only released
+ * by cbpt_destroy(); this keeps every node a concurrent reader may still
+ * be looking at alive without any reclamation scheme.
+ *
+ * @param order maximum number of pointers in a node, at least 3
+ *
+ * @return newly created concurrent bplus tree, NULL on invalid order or out of memory
+ */
+struct cbpt* cbpt_create(int order);
+
+/**
+ * Destroy a concurrent bplus tree
+ *
+ * Must not run concurrently with any other call on the tree.
+ *
+ * @param self concurrent bplus tree
+ */
+void cbpt_destroy(struct cbpt* self);
+
+/**
+ * Get number of elements
+ *
+ * @param self concurrent bplus tree
+ *
+ * @return number of elements
+ */
+size_t cbpt_size(struct cbpt* self);
+
+/**
+ * Put key and value into concurrent bplus tree
+ *
+ * @param self concurrent bplus tree
+ * @param key key
+ * @param value value
+ *
+ * @return key and value inserted or not. false if key already exists or out of memory
+ */
+bool cbpt_put(struct cbpt* self, void* key, void* value);
+
+/**
+ * Remove element using key
+ *
+ * @param self concurrent bplus tree
+ * @param key key
+ *
+ * @return element is removed or not
+ */
+bool cbpt_remove(struct cbpt* self, void* key);
+
+/**
+ * Get element from concurrent bplus tree
+ *
+ * @param self concurrent bplus tree
+ * @param key key
+ *
+ * @return element or NULL
+ */
+void* cbpt_get(struct cbpt* self, void* key);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,396 @@
+/*
+    libtds: tiny data structures
+    Copyright (C) 2017 junhee lee
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <string.h>
+#include <assert.h>
+
+#include "compactaatree.h"
+
+#define COMPACTAATREE_INDEX_MASK ((1u << COMPACTAATREE_INDEX_BITS) - 1)
+#define COMPACTAATREE_POOL_MIN 64
+
+typedef struct compactaatree_node node;
+
+// NODE FIELDS.
+
+/* Index 0 is the bottom sentinel: level 0 and both children itself, so the
+ * balancing code never has to test for missing children.
+ */
+static inline node* at(struct compactaatree* self, uint32_t index) {
+	return &self->nodes[index];
+}
+
+static inline uint32_t left(struct compactaatree* self, uint32_t index) {
+	return at(self, index)->left & COMPACTAATREE_INDEX_MASK;
+}
+
+static inline uint32_t right(struct compactaatree* self, uint32_t index) {
+	return at(self, index)->right;
+}
+
+static inline int level(struct compactaatree* self, uint32_t index) {
+	return at(self, index)->left >> COMPACTAATREE_INDEX_BITS;
+}
+
+static inline void set_left(struct compactaatree* self, uint32_t index, uint32_t child) {
+	node* n = at(self, index);
+	n->left = (n->left & ~COMPACTAATREE_INDEX_MASK) | child;
+}
+
+static inline void set_right(struct compactaatree* self, uint32_t index, uint32_t child) {
+	at(self, index)->right = child;
+}
+
+static inline void set_level(struct compactaatree* self, uint32_t index, int level) {
+	node* n = at(self, index);
+	n->left = (n->left & COMPACTAATREE_INDEX_MASK) | ((uint32_t)level << COMPACTAATREE_INDEX_BITS);
+}
+
+// POOL.
+
+/* Makes sure the next make_node() succeeds without growing the pool, so
+ * that indices and node pointers taken after it stay valid.
+ */
+static bool reserve_node(struct compactaatree* self) {
+	if(self->free_nodes || self->used < self->capacity)
+		return true;
+
+	if(self->capacity > COMPACTAATREE_MAX_SIZE)
+		return false;
+
+	uint32_t capacity = self->capacity * 2;
+	if(capacity > COMPACTAATREE_MAX_SIZE + 1)
+		capacity = COMPACTAATREE_MAX_SIZE + 1;
+
+	node* nodes = (node*)realloc(self->nodes, (size_t)capacity * sizeof(node));
+	if(!nodes)
+		return false;
+
+	self->nodes = nodes;
+	self->capacity = capacity;
+	return true;
+}
+
+static uint32_t make_node(struct compactaatree* self, void* value) {
+	uint32_t index = self->free_nodes;
+	if(index)
+		self->free_nodes = left(self, index);
+	else
+		index = self->used++;
+
+	node* n = at(self, index);
+	n->value = value;
+	n->left = 1u << COMPACTAATREE_INDEX_BITS; // level 1, no children
+	n->right = 0;
+	return index;
+}
+
+static void release_node(struct compactaatree* self, uint32_t index) {
+	node* n = at(self, index);
+	n->value = NULL;
+	n->left = self->free_nodes;
+	self->free_nodes = index;
+}
+
+// BALANCING.
+
+/* Both take the root of a subtree and return its new root; the caller
+ * links it back into the parent.
+ */
+
+// skew (rotate right)
+static uint32_t skew(struct compactaatree* self, uint32_t t) {
+	if(!t || level(self, left(self, t)) != level(self, t))
+		return t;
+
+	uint32_t l = left(self, t);
+	set_left(self, t, right(self, l));
+	set_right(self, l, t);
+	return l;
+}
+
+// split (rotate left)
+static uint32_t split(struct compactaatree* self, uint32_t t) {
+	if(!t || level(self, right(self, right(self, t))) != level(self, t))
+		return t;
+
+	uint32_t r = right(self, t);
+	set_right(self, t, left(self, r));
+	set_left(self, r, t);
+	set_level(self, r, level(self, r) + 1);
+	return r;
+}
+
+static inline void link(struct compactaatree* self, uint32_t parent, bool is_right, uint32_t child) {
+	if(is_right)
+		set_right(self, parent, child);
+	else
+		set_left(self, parent, child);
+}
+
+// TREE.
+
+struct compactaatree* compactaatree_create(compactaatree_compare compare) {
+	struct compactaatree* self = (struct compactaatree*)calloc(1, sizeof(struct compactaatree));
+	if(!self)
+		return NULL;
+
+	self->nodes = (node*)calloc(COMPACTAATREE_POOL_MIN, sizeof(node));
+	if(!self->nodes) {
+		free(self);
+		return NULL;
+	}
+
+	self->capacity = COMPACTAATREE_POOL_MIN;
+	self->used = 1; // the bottom sentinel, all zero
+	self->compare = compare;
+	return self;
+}
+
+void compactaatree_destroy(struct compactaatree* self) {
+	free(self->nodes);
+	memset(self, 0, sizeof(struct compactaatree)), free(self);
+}
+
+size_t compactaatree_size(struct compactaatree* self) {
+	return self->size;
+}
+
+int compactaatree_insert(struct compactaatree* self, void* value) {
+	if(!reserve_node(self))
+		return 1;
+
+	// search down the tree, remembering every node passed and the way we went
+	uint32_t path[COMPACTAATREE_MAX_HEIGHT];
+	bool went_right[COMPACTAATREE_MAX_HEIGHT];
+	int depth = 0;
+	uint32_t t = self->root;
+	while(t) {
+		int cmp = self->compare(value, at(self, t)->value);
+		if(cmp == 0)
+			return 1; // key conflict
+
+		assert(depth < COMPACTAATREE_MAX_HEIGHT);
+		path[depth] = t;
+		went_right[depth++] = cmp > 0;
+		t = cmp < 0 ? left(self, t) : right(self, t);
+	}
+
+	uint32_t child = make_node(self, value);
+	self->size += 1;
+
+	// on the way back, we link and rebalance. split looks two levels down,
+	// so we can stop once two subtrees in a row come out unchanged
+	int unchanged = 0;
+	while(depth--) {
+		t = path[depth];
+		link(self, t, went_right[depth], child);
+
+		int old_level = level(self, t);
+		child = split(self, skew(self, t));
+		if(child == t && level(self, t) == old_level) {
+			if(++unchanged == 2)
+				return 0;
+		} else {
+			unchanged = 0;
+		}
+	}
+
+	self->root = child;
+	return 0;
+}
+
+int compactaatree_remove(struct compactaatree* self, void* value) {
+	// search down the tree, the last node passed on the right is the candidate
+	uint32_t path[COMPACTAATREE_MAX_HEIGHT];
+	bool went_right[COMPACTAATREE_MAX_HEIGHT];
+	int depth = 0;
+	uint32_t deleted = 0;
+	uint32_t t = self->root;
+	while(t) {
+		int cmp = self->compare(value, at(self, t)->value);
+		assert(depth < COMPACTAATREE_MAX_HEIGHT);
+		path[depth] = t;
+		went_right[depth++] = cmp >= 0;
+		if(cmp < 0) {
+			t = left(self, t);
+		} else {
+			deleted = cmp == 0 ? t : 0;
+			t = right(self, t);
+		}
+	}
+
+	if(!deleted)
+		return 1;
+
+	// at the bottom of the tree we remove the last node passed, its value moves up
+	uint32_t last = path[--depth];
+	at(self, deleted)->value = at(self, last)->value;
+	uint32_t child = right(self, last);
+	release_node(self, last);
+	self->size -= 1;
+
+	// on the way back, we link and rebalance until a node keeps its level
+	while(depth--) {
+		t = path[depth];
+		link(self, t, went_right[depth], child);
+
+		int l = level(self, t);
+		if(level(self, left(self, t)) >= l - 1 && level(self, right(self, t)) >= l - 1)
+			return 0;
+
+		set_level(self, t, l - 1);
+		if(level(self, right(self, t)) > l - 1)
+			set_level(self, right(self, t), l - 1);
+
+		t = skew(self, t);
+		set_right(self, t, skew(self, right(self, t)));
+		uint32_t r = right(self, t);
+		if(r)
+			set_right(self, r, skew(self, right(self, r)));
+
+		t = split(self, t);
+		set_right(self, t, split(self, right(self, t)));
+		child = t;
+	}
+
+	self->root = child;
+	return 0;
+}
+
+void* compactaatree_find(struct compactaatree* self, void* value) {
+	uint32_t t = self->root;
+	while(t) {
+		node* n = at(self, t);
+		int cmp = self->compare(value, n->value);
+		if(cmp == 0)
+			return n->value;
+
+		t = cmp < 0 ? n->left & COMPACTAATREE_INDEX_MASK : n->right;
+	}
+
+	return NULL;
+}
+
+void* compactaatree_find_min(struct compactaatree* self) {
+	uint32_t t = self->root;
+	if(!t)
+		return NULL;
+
+	while(left(self, t))
+		t = left(self, t);
+	return at(self, t)->value;
+}
+
+void* compactaatree_find_max(struct compactaatree* self) {
+	uint32_t t = self->root;
+	if(!t)
+		return NULL;
+
+	while(right(self, t))
+		t = right(self, t);
+	return at(self, t)->value;
+}
+
+#ifndef NDBUG
+#include <stdio.h>
+#include <time.h>
+
+// verify AA tree invariants and ordering, return number of nodes
+static size_t check_node(struct compactaatree* self, uint32_t t, intptr_t lo, intptr_t hi) {
+	if(!t)
+		return 0;
+
+	intptr_t value = (intptr_t)at(self, t)->value;
+	int l = level(self, t);
+	assert(lo < value && value < hi);
+	assert(level(self, left(self, t)) == l - 1);
+	assert(level(self, right(self, t)) == l || level(self, right(self, t)) == l - 1);
+	assert(level(self, right(self, right(self, t))) < l);
+	return check_node(self, left(self, t), lo, value) + 1 + check_node(self, right(self, t), value, hi);
+}
+
+int int_compare(void* a_lhs, void* a_rhs) {
+	intptr_t lhs = (intptr_t)a_lhs, rhs = (intptr_t)a_rhs;
+	return (lhs > rhs) - (lhs < rhs);
+}
+
+int main(int argc, char** argv) {
+	assert(sizeof(struct compactaatree_node) == 16);
+
+	// random operations against a reference set
+	struct compactaatree* tree = compactaatree_create(int_compare);
+	bool present[1024] = { false };
+	srand(0);
+	for(int i = 0; i < 200000; ++i) {
+		intptr_t value = rand() % 1024 + 1;
+		if(rand() % 2) {
+			assert(compactaatree_insert(tree, (void*)value) == (present[value - 1] ? 1 : 0));
+			present[value - 1] = true;
+		} else {
+			assert(compactaatree_remove(tree, (void*)value) == (present[value - 1] ? 0 : 1));
+			present[value - 1] = false;
+		}
+		if(i % 1000 == 0)
+			assert(check_node(tree, tree->root, 0, 1025) == tree->size);
+	}
+	size_t expected = 0;
+	intptr_t min = 0, max = 0;
+	for(intptr_t i = 1; i <= 1024; ++i) {
+		assert(compactaatree_find(tree, (void*)i) == (present[i - 1] ? (void*)i : NULL));
+		if(present[i - 1]) {
+			expected += 1;
+			min = min ? min : i;
+			max = i;
+		}
+	}
+	assert(check_node(tree, tree->root, 0, 1025) == expected && tree->size == expected);
+	assert((intptr_t)compactaatree_find_min(tree) == min && (intptr_t)compactaatree_find_max(tree) == max);
+	assert(tree->used <= 1025);
+	compactaatree_destroy(tree);
+
+	// throughput test
+	tree = compactaatree_create(int_compare);
+	clock_t b, e;
+	b = clock();
+	for(intptr_t i = 1; i <= 1000000; ++i)
+		compactaatree_insert(tree, (void*)i);
+	e = clock();
+	printf("[INSERT] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	assert(check_node(tree, tree->root, 0, 1000001) == 1000000);
+
+	b = clock();
+	size_t found = 0;
+	for(intptr_t i = 1; i <= 1000000; ++i)
+		found += compactaatree_find(tree, (void*)(intptr_t)(rand() % 1000000 + 1)) != NULL;
+	e = clock();
+	printf("[FIND] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	assert(found == 1000000);
+
+	b = clock();
+	for(intptr_t i = 1; i <= 1000000; ++i)
+		compactaatree_remove(tree, (void*)i);
+	e = clock();
+	printf("[DELETE] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	assert(tree->size == 0 && tree->root == 0);
+
+	compactaatree_destroy(tree);
+	return 0;
+}
+#endif
@@ -0,0 +1,161 @@
+/*
+    libtds: tiny data structures
+    Copyright (C) 2017 junhee lee
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __COMPACTAATREE_H__
+#define __COMPACTAATREE_H__
+
+/**
+ * @file
+ * AA tree with 16 byte nodes
+ *
+ * Nodes live in a single pool owned by the tree and link to each other by
+ * 32-bit pool index instead of by pointer. The level of a node is packed
+ * into the spare high bits of its left index, so a node is a value and two
+ * indices: 16 bytes, four nodes per cache line.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/**
+ * bits of a pool index, the remaining high bits of left hold the level
+ */
+#define COMPACTAATREE_INDEX_BITS 26
+
+/**
+ * maximum number of elements, pool index 0 is the bottom sentinel
+ */
+#define COMPACTAATREE_MAX_SIZE ((1u << COMPACTAATREE_INDEX_BITS) - 2)
+
+/**
+ * maximum height of a tree, at most 2 * log2(n + 1)
+ */
+#define COMPACTAATREE_MAX_HEIGHT (2 * COMPACTAATREE_INDEX_BITS)
+
+typedef int (*compactaatree_compare)(void* lhs, void* rhs);
+
+/**
+ * compact AA tree node
+ */
+struct compactaatree_node {
+	void*		value;	///< element
+	uint32_t	left;	///< left child index, level in the high bits
+	uint32_t	right;	///< right child index
+};
+
+/**
+ * compact AA tree
+ */
+struct compactaatree {
+	struct compactaatree_node* nodes;	///< node pool, nodes[0] is the bottom sentinel
+	uint32_t capacity;					///< nodes in the pool
+	uint32_t used;						///< nodes ever handed out from the pool
+	uint32_t free_nodes;				///< released nodes, linked through left, 0 for none
+	uint32_t root;						///< root node index, 0 when empty
+	size_t size;						///< number of element
+	compactaatree_compare compare;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Create a new compact AA tree
+ *
+ * Values are compared like struct aatree values. The pool grows by
+ * doubling and moves when it does, so nodes must not be held on to
+ * across insertions.
+ *
+ * @param compare comparator
+ *
+ * @return newly created tree, NULL on out of memory
+ */
+struct compactaatree* compactaatree_create(compactaatree_compare compare);
+
+/**
+ * Destroy a compact AA tree
+ *
+ * @param self compact AA tree
+ */
+void compactaatree_destroy(struct compactaatree* self);
+
+/**
+ * Get number of elements
+ *
+ * @param self compact AA tree
+ *
+ * @return number of elements
+ */
+size_t compactaatree_size(struct compactaatree* self);
+
+/**
+ * Insert value
+ *
+ * @param self compact AA tree
+ * @param value value
+ *
+ * @return 0 on success, 1 if an equal value exists, the tree is full or out of memory
+ */
+int compactaatree_insert(struct compactaatree* self, void* value);
+
+/**
+ * Remove the value equal to value
+ *
+ * @param self compact AA tree
+ * @param value value
+ *
+ * @return 0 on success, 1 if no equal value exists
+ */
+int compactaatree_remove(struct compactaatree* self, void* value);
+
+/**
+ * Find the value equal to value
+ *
+ * @param self compact AA tree
+ * @param value value to look for
+ *
+ * @return value stored in the tree, or NULL
+ */
+void* compactaatree_find(struct compactaatree* self, void* value);
+
+/**
+ * Get the smallest value
+ *
+ * @param self compact AA tree
+ *
+ * @return smallest value, NULL when empty
+ */
+void* compactaatree_find_min(struct compactaatree* self);
+
+/**
+ * Get the largest value
+ *
+ * @param self compact AA tree
+ *
+ * @return largest value, NULL when empty
+ */
+void* compactaatree_find_max(struct compactaatree* self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,195 @@
+/*
+    libtds: tiny data structures
+    Copyright (C) 2017 junhee lee
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <string.h>
+#include <assert.h>
+
+#include "eytzinger.h"
+
+// slots are pointers, so a cache line holds the 8 slots 8k .. 8k + 7,
+// the great grandchildren of slot k
+#define EYTZINGER_LINE 64
+#define EYTZINGER_PREFETCH (EYTZINGER_LINE / sizeof(void*))
+
+static struct eytzinger* eytzinger_alloc(eytzinger_compare compare, size_t size);
+static void** eytzinger_fill(struct eytzinger* self, void** values, size_t k);
+
+struct eytzinger* eytzinger_create(eytzinger_compare compare, void** values, size_t size) {
+	for(size_t i = 1; i < size; ++i) {
+		if(compare(values[i - 1], values[i]) >= 0)
+			return NULL; // not strictly ascending
+	}
+
+	struct eytzinger* self = eytzinger_alloc(compare, size);
+	if(!self)
+		return NULL;
+
+	eytzinger_fill(self, values, 1);
+	return self;
+}
+
+struct eytzinger* eytzinger_freeze(struct aatree* tree) {
+	if(tree->node_compare)
+		return NULL; // values of intrusive trees are nodes
+
+	// the AA tree is walked in order into a sorted array first
+	void** values = (void**)malloc((tree->size + 1) * sizeof(void*));
+	if(!values)
+		return NULL;
+
+	struct aatree_iterator iterator;
+	struct aatree_node* node;
+	size_t size = 0;
+	aatree_range_node(tree, &iterator, NULL, NULL);
+	while((node = aatree_iterator_next(&iterator)))
+		values[size++] = node->value;
+
+	struct eytzinger* self = eytzinger_alloc(tree->compare, size);
+	if(self)
+		eytzinger_fill(self, values, 1);
+
+	free(values);
+	return self;
+}
+
+void eytzinger_destroy(struct eytzinger* self) {
+	free(self->values);
+	memset(self, 0, sizeof(struct eytzinger)), free(self);
+}
+
+size_t eytzinger_size(struct eytzinger* self) {
+	return self->size;
+}
+
+void* eytzinger_lower_bound(struct eytzinger* self, void* value) {
+	// descend without branching on the comparison, the path taken is
+	// recorded in the bits of k
+	void** values = self->values;
+	size_t k = 1;
+	while(k <= self->size) {
+		__builtin_prefetch(values + k * EYTZINGER_PREFETCH);
+		k = 2 * k + (self->compare(values[k], value) < 0);
+	}
+
+	// strip the right turns taken after the last left one, k is then the
+	// slot where we last went left, 0 if we never did
+	k >>= __builtin_ffsll(~k);
+	return k ? values[k] : NULL;
+}
+
+void* eytzinger_find(struct eytzinger* self, void* value) {
+	void* candidate = eytzinger_lower_bound(self, value);
+	if(candidate && self->compare(candidate, value) == 0)
+		return candidate;
+	else
+		return NULL;
+}
+
+static struct eytzinger* eytzinger_alloc(eytzinger_compare compare, size_t size) {
+	struct eytzinger* self = (struct eytzinger*)calloc(1, sizeof(struct eytzinger));
+	if(!self)
+		return NULL;
+
+	// slot 0 is unused, so slot 8k starts a cache line
+	size_t bytes = (size + 1) * sizeof(void*);
+	bytes = (bytes + EYTZINGER_LINE - 1) / EYTZINGER_LINE * EYTZINGER_LINE;
+	self->values = (void**)aligned_alloc(EYTZINGER_LINE, bytes);
+	if(!self->values) {
+		free(self);
+		return NULL;
+	}
+
+	self->values[0] = NULL;
+	self->size = size;
+	self->compare = compare;
+	return self;
+}
+
+// place sorted values into the subtree rooted at slot k by an in-order walk,
+// return the values not placed yet
+static void** eytzinger_fill(struct eytzinger* self, void** values, size_t k) {
+	if(k > self->size)
+		return values;
+
+	values = eytzinger_fill(self, values, 2 * k);
+	self->values[k] = *values++;
+	return eytzinger_fill(self, values, 2 * k + 1);
+}
+
+#ifndef NDBUG
+#include <stdio.h>
+#include <time.h>
+
+int int_compare(void* a_lhs, void* a_rhs) {
+	intptr_t lhs = (intptr_t)a_lhs, rhs = (intptr_t)a_rhs;
+	return (lhs > rhs) - (lhs < rhs);
+}
+
+int main(int argc, char** argv) {
+	// every size against the sorted array
+	void** values = (void**)malloc(1000000 * sizeof(void*));
+	for(intptr_t i = 0; i < 1000000; ++i)
+		values[i] = (void*)(i * 2 + 2);
+	for(size_t size = 0; size < 300; ++size) {
+		struct eytzinger* tree = eytzinger_create(int_compare, values, size);
+		assert(eytzinger_size(tree) == size);
+		for(intptr_t i = 0; i < (intptr_t)size * 2 + 4; ++i) {
+			intptr_t lower = i <= 2 ? 2 : (i + 1) / 2 * 2;
+			assert(eytzinger_find(tree, (void*)i) == (i % 2 == 0 && i >= 2 && i <= (intptr_t)size * 2 ? (void*)i : NULL));
+			assert(eytzinger_lower_bound(tree, (void*)i) == (lower <= (intptr_t)size * 2 ? (void*)lower : NULL));
+		}
+		eytzinger_destroy(tree);
+	}
+	values[1] = values[0];
+	assert(eytzinger_create(int_compare, values, 2) == NULL);
+	values[1] = (void*)(intptr_t)4;
+
+	// against the AA tree it is frozen from
+	struct aatree* aatree = aatree_build_sorted(int_compare, values, 1000000);
+	struct eytzinger* tree = eytzinger_freeze(aatree);
+	assert(eytzinger_size(tree) == 1000000);
+	srand(0);
+	intptr_t* keys = (intptr_t*)malloc(1000000 * sizeof(intptr_t));
+	for(int i = 0; i < 1000000; ++i)
+		keys[i] = rand() % 2000004;
+	for(int i = 0; i < 1000000; ++i)
+		assert(eytzinger_find(tree, (void*)keys[i]) == aatree_find(aatree, (void*)keys[i]));
+
+	clock_t b, e;
+	size_t found = 0;
+	b = clock();
+	for(int i = 0; i < 1000000; ++i)
+		found += aatree_find(aatree, (void*)keys[i]) != NULL;
+	e = clock();
+	printf("[AATREE FIND] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+
+	b = clock();
+	for(int i = 0; i < 1000000; ++i)
+		found -= eytzinger_find(tree, (void*)keys[i]) != NULL;
+	e = clock();
+	printf("[EYTZINGER FIND] elapsed time: %lf\n", (e - b) / (double)CLOCKS_PER_SEC);
+	assert(found == 0);
+
+	eytzinger_destroy(tree);
+	aatree_destroy(aatree);
+	free(keys);
+	free(values);
+	return 0;
+}
+#endif
@@ -0,0 +1,116 @@
+/*
+    libtds: tiny data structures
+    Copyright (C) 2017 junhee lee
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __EYTZINGER_H__
+#define __EYTZINGER_H__
+
+/**
+ * @file
+ * Frozen search tree in Eytzinger (breadth first) layout
+ *
+ * The tree is a flat array: the children of slot k are slots 2k and 2k + 1,
+ * so a search needs no pointers and the slots of the next levels can be
+ * prefetched while the current one is compared.
+ * @see [Array Layouts for Comparison-Based Searching](https://arxiv.org/abs/1509.05053)
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "aatree.h"
+
+typedef int (*eytzinger_compare)(void* lhs, void* rhs);
+
+/**
+ * frozen search tree
+ */
+struct eytzinger {
+	void** values;				///< values in Eytzinger order, from slot 1
+	size_t size;				///< number of element
+	eytzinger_compare compare;	///< same comparator semantics as struct aatree
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Create a frozen search tree from a sorted array
+ *
+ * @param compare comparator
+ * @param values values in strictly ascending order, copied
+ * @param size number of values
+ *
+ * @return newly created tree, NULL if values are not strictly ascending or out of memory
+ */
+struct eytzinger* eytzinger_create(eytzinger_compare compare, void** values, size_t size);
+
+/**
+ * Freeze an AA tree
+ *
+ * The AA tree is left untouched, later changes to it are not seen by the frozen tree.
+ *
+ * @param tree value AA tree
+ *
+ * @return newly created tree, NULL for intrusive AA trees or out of memory
+ */
+struct eytzinger* eytzinger_freeze(struct aatree* tree);
+
+/**
+ * Destroy a frozen search tree
+ *
+ * @param self frozen search tree
+ */
+void eytzinger_destroy(struct eytzinger* self);
+
+/**
+ * Get number of elements
+ *
+ * @param self frozen search tree
+ *
+ * @return number of elements
+ */
+size_t eytzinger_size(struct eytzinger* self);
+
+/**
+ * Find the value equal to value, like aatree_find()
+ *
+ * @param self frozen search tree
+ * @param value value to look for
+ *
+ * @return value stored in the tree, or NULL
+ */
+void* eytzinger_find(struct eytzinger* self, void* value);
+
+/**
+ * Find the smallest value not less than value, like aatree_lower_bound()
+ *
+ * @param self frozen search tree
+ * @param value value to look for
+ *
+ * @return value stored in the tree, or NULL
+ */
+void* eytzinger_lower_bound(struct eytzinger* self, void* value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -23,6 +23,8 @@
 static struct pairingheap_node* pairingheap_node_create(void* value);
 static void pairingheap_node_destroy(struct pairingheap_node* base, bool recursively);
 static struct pairingheap_node* pairingheap_node_merge(struct pairingheap* self, struct pairingheap_node* lhs, struct pairingheap_node* rhs);
+static struct pairingheap_node* pairingheap_node_combine(struct pairingheap* self, struct pairingheap_node* first);
+static void pairingheap_node_cut(struct pairingheap_node* node);
 
 struct pairingheap* pairingheap_create(pairingheap_compare compare) {
 	struct pairingheap* self = (struct pairingheap*)calloc(1, sizeof(struct pairingheap));
@@ -43,13 +45,17 @@ size_t pairingheap_size(struct pairingheap* self) {
 }
 
 int pairingheap_push(struct pairingheap* self, void* value) {
+	return pairingheap_push_handle(self, value) ? 0 : 1;
+}
+
+struct pairingheap_node* pairingheap_push_handle(struct pairingheap* self, void* value) {
 	struct pairingheap_node* node = pairingheap_node_create(value);
 	if(!node)
-		return 1;
+		return NULL;
 
 	self->root = pairingheap_node_merge(self, self->root, node);
 	self->size += 1;
-	return 0;
+	return node;
 }
 
 void* pairingheap_pop(struct pairingheap* self) {
@@ -57,80 +63,53 @@ void* pairingheap_pop(struct pairingheap* self) {
 		return NULL;
 
 	struct pairingheap_node* root = self->root;
-	void* value = self->root->value;
-
-	if(self->size == 1) {
-		pairingheap_node_destroy(root, true);
-		self->root = NULL;
-		self->size = 0;
-		return value;
-	}
+	void* value = root->value;
 
-	struct pairingheap_node* pass1_default[1024];
-
-	// first pass: left to right merging
-	struct pairingheap_node** pass1 = pass1_default;
-	size_t pass1_capacity = sizeof(pass1_default) / sizeof(pass1_default[0]);
-	size_t pass1_size = 0;
+	self->root = pairingheap_node_combine(self, root->down);
+	pairingheap_node_destroy(root, false);
+	self->size -= 1;
+	return value;
+}
 
-	struct pairingheap_node* link = root->down;
-	while(link) {
-		struct pairingheap_node* left = link;
-		link = link->right;
+int pairingheap_meld(struct pairingheap* self, struct pairingheap* other) {
+	// values ordered by another comparator would break the heap order
+	if(self->compare != other->compare)
+		return 1;
 
-		struct pairingheap_node* right = link;
-		if(!right) {
-			struct pairingheap_node** lastnode;
-			if(pass1_size)
-				lastnode = &pass1[pass1_size - 1];
-			else {
-				lastnode = &pass1[0];
-				*lastnode = NULL;
-				pass1_size += 1;
-			}
+	if(self == other)
+		return 0;
 
-			*lastnode = pairingheap_node_merge(self, *lastnode, left);
-			break;
-		}
-		link = link->right;
+	self->root = pairingheap_node_merge(self, self->root, other->root);
+	self->size += other->size;
+	other->root = NULL;
+	other->size = 0;
+	return 0;
+}
 
-		struct pairingheap_node* merged = pairingheap_node_merge(self, left, right);
-		pass1[pass1_size++] = merged;
-
-		if(pass1_size == pass1_capacity) {
-			struct pairingheap_node** tmp = pass1;
-
-			pass1 = (struct pairingheap_node**)malloc(sizeof(struct pairingheap_node*) * (pass1_capacity * 2));
-			if(!pass1) {
-				pass1 = tmp;
-				struct pairingheap_node** lastnode = &pass1[pass1_size - 1];
-				while(link) {
-					*lastnode = pairingheap_node_merge(self, *lastnode, link);
-					link = link->right;
-				}
-				break;
-			}
-			memcpy(pass1, tmp, sizeof(struct pairingheap_node*) * pass1_size);
-			pass1_capacity *= 2;
+int pairingheap_decrease_key(struct pairingheap* self, struct pairingheap_node* node, void* value) {
+	if(self->compare(value, node->value) > 0)
+		return 1;
 
-			if(tmp != pass1_default)
-				free(tmp);
-		}
-	}
+	node->value = value;
+	if(node == self->root)
+		return 0;
 
-	pairingheap_node_destroy(self->root, false), self->root = NULL;
+	// the subtree under node stays ordered, it is cut off and merged with the root
+	pairingheap_node_cut(node);
+	self->root = pairingheap_node_merge(self, self->root, node);
+	return 0;
+}
 
-	// second pass: right to left merging
-	root = pass1[--pass1_size];
-	while(pass1_size)
-		root = pairingheap_node_merge(self, root, pass1[--pass1_size]);
+void* pairingheap_remove(struct pairingheap* self, struct pairingheap_node* node) {
+	if(node == self->root)
+		return pairingheap_pop(self);
 
-	self->root = root;
+	// the children of node are combined like on pop, then merged with the root
+	void* value = node->value;
+	pairingheap_node_cut(node);
+	self->root = pairingheap_node_merge(self, self->root, pairingheap_node_combine(self, node->down));
+	pairingheap_node_destroy(node, false);
 	self->size -= 1;
-
-	if(pass1 != pass1_default)
-		free(pass1);
-
 	return value;
 }
 
@@ -148,11 +127,15 @@ static struct pairingheap_node* pairingheap_node_create(void* value) {
 }
 
 static void pairingheap_node_destroy(struct pairingheap_node* base, bool recursively) {
+	if(!base)
+		return;
+
 	if(recursively) {
 		struct pairingheap_node* link = base->down;
 		while(link) {
+			struct pairingheap_node* next = link->right;
 			pairingheap_node_destroy(link, true);
-			link = link->right;
+			link = next;
 		}
 	}
 	free(base);
@@ -172,12 +155,64 @@ static struct pairingheap_node* pairingheap_node_merge(struct pairingheap* self,
 	else
 		parent = rhs, child = lhs;
 
+	child->left = parent;
 	child->right = parent->down;
+	if(parent->down)
+		parent->down->left = child;
 	parent->down = child;
 
 	return parent;
 }
 
+// merge a list of siblings into a single tree in two passes
+static struct pairingheap_node* pairingheap_node_combine(struct pairingheap* self, struct pairingheap_node* first) {
+	// first pass: left to right merging of pairs, stacked up through right
+	struct pairingheap_node* pairs = NULL;
+	while(first) {
+		struct pairingheap_node* lhs = first;
+		struct pairingheap_node* rhs = lhs->right;
+		first = rhs ? rhs->right : NULL;
+
+		lhs->left = lhs->right = NULL;
+		if(rhs)
+			rhs->left = rhs->right = NULL;
+
+		struct pairingheap_node* merged = pairingheap_node_merge(self, lhs, rhs);
+		merged->right = pairs;
+		pairs = merged;
+	}
+
+	// second pass: right to left merging, the stack holds the rightmost pair on top
+	struct pairingheap_node* root = pairs;
+	if(!root)
+		return NULL;
+
+	pairs = root->right;
+	root->right = NULL;
+	while(pairs) {
+		struct pairingheap_node* next = pairs->right;
+		pairs->right = NULL;
+		root = pairingheap_node_merge(self, root, pairs);
+		pairs = next;
+	}
+
+	return root;
+}
+
+// unlink node from its parent and siblings, together with its subtree
+static void pairingheap_node_cut(struct pairingheap_node* node) {
+	// left is the parent for the first child, the previous sibling otherwise
+	if(node->left->down == node)
+		node->left->down = node->right;
+	else
+		node->left->right = node->right;
+
+	if(node->right)
+		node->right->left = node->left;
+
+	node->left = node->right = NULL;
+}
+
 #ifndef NDEBUG
 #include <stdio.h>
 static void pairingheap_node_dump(struct pairingheap_node* node, int depth) {
@@ -208,6 +243,10 @@ static int int_compare(void* a_lhs, void* a_rhs) {
 	return (intptr_t)a_lhs - (intptr_t)a_rhs;
 }
 
+static int reverse_int_compare(void* a_lhs, void* a_rhs) {
+	return (intptr_t)a_rhs - (intptr_t)a_lhs;
+}
+
 #include <assert.h>
 #include <locale.h>
 #include <time.h>
@@ -237,6 +276,77 @@ int main(int argc, char** argv) {
 		pairingheap_node_dump(queue->root, 0);
 	}
 
+	// handles against a reference array: decrease keys and remove at random
+	{
+		enum { COUNT = 4096 };
+		static struct pairingheap_node* handles[COUNT];
+		static intptr_t keys[COUNT];
+		srand(0);
+		for(int i = 0; i < COUNT; ++i) {
+			keys[i] = (rand() % 100000) * COUNT + i; // distinct, the index in the low bits
+			handles[i] = pairingheap_push_handle(queue, (void*)keys[i]);
+			assert(handles[i] && handles[i]->value == (void*)keys[i]);
+		}
+		for(int i = 0; i < 20000; ++i) {
+			int index = rand() % COUNT;
+			if(!handles[index])
+				continue;
+
+			if(rand() % 4) {
+				intptr_t key = keys[index] - (rand() % 1000) * COUNT;
+				assert(pairingheap_decrease_key(queue, handles[index], (void*)key) == 0);
+				keys[index] = key;
+				assert(pairingheap_decrease_key(queue, handles[index], (void*)(key + COUNT)) == 1);
+			} else {
+				assert(pairingheap_remove(queue, handles[index]) == (void*)keys[index]);
+				handles[index] = NULL;
+			}
+		}
+
+		size_t remaining = 0;
+		for(int i = 0; i < COUNT; ++i)
+			remaining += handles[i] != NULL;
+		assert(pairingheap_size(queue) == remaining);
+
+		intptr_t prev = INTPTR_MIN;
+		while(pairingheap_size(queue)) {
+			intptr_t key = (intptr_t)pairingheap_pop(queue);
+			int index = ((key % COUNT) + COUNT) % COUNT;
+			assert(key > prev && handles[index] && keys[index] == key);
+			handles[index] = NULL;
+			prev = key;
+		}
+		assert(pairingheap_pop(queue) == NULL);
+		puts("handle tests passed");
+	}
+
+	// meld moves every node, handles included, and empties the other heap
+	{
+		struct pairingheap* other = pairingheap_create(int_compare);
+		struct pairingheap_node* handle = NULL;
+		for(intptr_t i = 0; i < 1000; ++i) {
+			pairingheap_push(queue, (void*)(i * 2 + 10));
+			struct pairingheap_node* node = pairingheap_push_handle(other, (void*)(i * 2 + 11));
+			handle = i == 500 ? node : handle;
+		}
+		assert(pairingheap_meld(queue, other) == 0);
+		assert(pairingheap_size(queue) == 2000 && pairingheap_size(other) == 0 && pairingheap_pop(other) == NULL);
+		assert(pairingheap_decrease_key(queue, handle, (void*)1) == 0);
+		assert(pairingheap_pop(queue) == (void*)1);
+		for(intptr_t i = 10; i < 2010; ++i) {
+			if(i != 1011)
+				assert(pairingheap_pop(queue) == (void*)i);
+		}
+		assert(pairingheap_meld(queue, queue) == 0 && pairingheap_size(queue) == 0);
+
+		struct pairingheap* reversed = pairingheap_create(reverse_int_compare);
+		pairingheap_push(reversed, (void*)1);
+		assert(pairingheap_meld(queue, reversed) == 1 && pairingheap_size(reversed) == 1);
+		pairingheap_destroy(reversed);
+		pairingheap_destroy(other);
+		puts("meld tests passed");
+	}
+
 	srand(time(NULL));
 	struct timespec insert_start, insert_end;
 	int item_count = 10000000;
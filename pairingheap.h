@@ -32,6 +32,7 @@ struct pairingheap_node {
 	void* value;
 	struct pairingheap_node* down;
 	struct pairingheap_node* right;
+	struct pairingheap_node* left;	// previous sibling, or parent for the first child
 };
 
 /**
@@ -55,6 +56,31 @@ int pairingheap_push(struct pairingheap* self, void* value);
 void* pairingheap_pop(struct pairingheap* self);
 void* pairingheap_peek(struct pairingheap* self);
 
+/**
+ * Meld other into self in O(1)
+ *
+ * Every node of other moves to self, handles included, and other is left
+ * empty but still has to be destroyed. Heaps only meld when they share
+ * the same comparator function; otherwise 1 is returned and both heaps
+ * are left untouched.
+ */
+int pairingheap_meld(struct pairingheap* self, struct pairingheap* other);
+
+/**
+ * Node handles
+ *
+ * pairingheap_push_handle() returns the node holding value, NULL on out of
+ * memory. The handle stays valid until its value is popped or removed.
+ *
+ * pairingheap_decrease_key() replaces the value of node with one that does
+ * not compare greater, returns 1 and leaves the heap untouched otherwise.
+ *
+ * pairingheap_remove() takes node out of the heap, frees it and returns its value.
+ */
+struct pairingheap_node* pairingheap_push_handle(struct pairingheap* self, void* value);
+int pairingheap_decrease_key(struct pairingheap* self, struct pairingheap_node* node, void* value);
+void* pairingheap_remove(struct pairingheap* self, struct pairingheap_node* node);
+
 #ifdef __cplusplus
 }
 #endif